@@ -0,0 +1,430 @@
+// Allocator microbenchmarks, built once against the low-fat run-time
+// (bench_alloc_lowfat) and once against the allocator of the C library
+// (bench_alloc_glibc), e.g., to evaluate changes of the low-fat allocator.
+//
+// Every workload reports the allocator operations per second over all threads,
+// the 99th percentile latency of a sample of the operations, the peak resident
+// set size during the workload, and, for the low-fat build, the number of
+// allocations that were not low-fat (i.e., fell back to the system allocator).
+//
+// Usage: bench_alloc_{lowfat,glibc} [workload|all] [threads] [operations]
+//
+// The number of operations is per thread and workload (default 1000000).
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH_LOWFAT
+#include "core.h"
+#define ALLOCATOR "lowfat"
+#define IS_FALLBACK(ptr) ((ptr) != NULL && !__is_lowfat(ptr))
+#else
+#define ALLOCATOR "glibc"
+#define IS_FALLBACK(ptr) 0
+#endif
+
+// Every SAMPLE_INTERVAL-th operation of a thread is timed individually, which
+// keeps the timer calls from dominating the throughput.
+#define SAMPLE_INTERVAL 16
+#define MAX_SAMPLES (1 << 16)
+
+typedef struct Thread Thread;
+typedef void (*workload_fn)(Thread *t);
+
+struct Thread {
+    pthread_t thread;
+    workload_fn fn;
+    unsigned id;
+    uint64_t rng;
+    size_t ops;
+    size_t fallbacks;
+    uint64_t *samples;
+    size_t num_samples;
+};
+
+static unsigned num_threads;
+static size_t ops_per_thread = 1000000;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(Thread *t) {
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return t->rng;
+}
+
+static size_t random_size(Thread *t, size_t min, size_t max) {
+    return min + next_random(t) % (max - min + 1);
+}
+
+// Perform the allocator operation `op`, and time it if it is sampled
+#define TIMED(t, op)                                                           \
+    do {                                                                       \
+        if (++(t)->ops % SAMPLE_INTERVAL == 0 &&                               \
+            (t)->num_samples < MAX_SAMPLES) {                                  \
+            uint64_t start_ = now_ns();                                        \
+            op;                                                                \
+            (t)->samples[(t)->num_samples++] = now_ns() - start_;              \
+        } else {                                                               \
+            op;                                                                \
+        }                                                                      \
+    } while (0)
+
+static void *bench_malloc(Thread *t, size_t size) {
+    void *ptr;
+    TIMED(t, ptr = malloc(size));
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    t->fallbacks += IS_FALLBACK(ptr);
+    // Touch the allocation like a program would
+    *(volatile char *)ptr = 1;
+    return ptr;
+}
+
+static void bench_free(Thread *t, void *ptr) { TIMED(t, free(ptr)); }
+
+//===----------------------------------------------------------------------===//
+//                                Workloads
+//===----------------------------------------------------------------------===//
+
+// Size-class sweep: allocate batches of objects of one size, and free them in
+// reverse order
+#define SWEEP_BATCH 256
+
+static size_t sweep_size;
+
+static void sweep(Thread *t) {
+    void *batch[SWEEP_BATCH];
+    while (t->ops < ops_per_thread) {
+        for (size_t i = 0; i < SWEEP_BATCH; i++) {
+            batch[i] = bench_malloc(t, sweep_size);
+        }
+        for (size_t i = SWEEP_BATCH; i > 0; i--) {
+            bench_free(t, batch[i - 1]);
+        }
+    }
+}
+
+// Producer/consumer: every even thread allocates objects and passes them to
+// the next thread through a ring buffer, which frees them
+#define RING_SIZE 1024
+
+typedef struct Ring {
+    _Atomic size_t head;
+    char pad[64];
+    _Atomic size_t tail;
+    void *slots[RING_SIZE];
+} Ring;
+
+static Ring *rings;
+
+static void producer_consumer(Thread *t) {
+    Ring *ring = &rings[t->id / 2];
+    size_t items = ops_per_thread / 2;
+    if (t->id % 2 == 0) {
+        for (size_t i = 0; i < items; i++) {
+            void *ptr = bench_malloc(t, random_size(t, 16, 512));
+            size_t head = atomic_load_explicit(&ring->head,
+                                               memory_order_relaxed);
+            while (head - atomic_load_explicit(&ring->tail,
+                                               memory_order_acquire) ==
+                   RING_SIZE) {
+                sched_yield();
+            }
+            ring->slots[head % RING_SIZE] = ptr;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+    } else {
+        for (size_t i = 0; i < items; i++) {
+            size_t tail = atomic_load_explicit(&ring->tail,
+                                               memory_order_relaxed);
+            while (atomic_load_explicit(&ring->head, memory_order_acquire) ==
+                   tail) {
+                sched_yield();
+            }
+            void *ptr = ring->slots[tail % RING_SIZE];
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            bench_free(t, ptr);
+        }
+    }
+}
+
+// Realloc growth: grow buffers from 16 bytes to 1 MiB in steps of 25%
+#define REALLOC_MAX_SIZE (1 << 20)
+
+static void realloc_growth(Thread *t) {
+    while (t->ops < ops_per_thread) {
+        char *buffer = NULL;
+        for (size_t size = 16; size <= REALLOC_MAX_SIZE; size += size / 4) {
+            TIMED(t, buffer = realloc(buffer, size));
+            if (buffer == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            t->fallbacks += IS_FALLBACK(buffer);
+            buffer[size - 1] = 1;
+        }
+        bench_free(t, buffer);
+    }
+}
+
+// Aligned allocation: replace random objects of a small working set with
+// objects of random size and alignment (16 bytes to one page)
+#define ALIGNED_WORKING_SET 64
+
+static void aligned(Thread *t) {
+    void *live[ALIGNED_WORKING_SET] = {NULL};
+    while (t->ops < ops_per_thread) {
+        size_t slot = next_random(t) % ALIGNED_WORKING_SET;
+        size_t alignment = (size_t)16 << (next_random(t) % 9);
+        size_t size = random_size(t, 16, 2048);
+        if (live[slot]) {
+            bench_free(t, live[slot]);
+        }
+        int res;
+        TIMED(t, res = posix_memalign(&live[slot], alignment, size));
+        if (res != 0) {
+            fprintf(stderr, "posix_memalign: %s\n", strerror(res));
+            exit(1);
+        }
+        t->fallbacks += IS_FALLBACK(live[slot]);
+    }
+    for (size_t i = 0; i < ALIGNED_WORKING_SET; i++) {
+        free(live[i]);
+    }
+}
+
+// Larson-style server: every thread replaces random objects of its set of
+// live objects. The threads end after every round, and the sets are handed to
+// the threads of the next round, which free the objects of other threads.
+#define LARSON_OBJECTS 1000
+#define LARSON_ROUNDS 8
+
+static void **larson_sets;
+static unsigned larson_round;
+
+static void larson(Thread *t) {
+    void **set = &larson_sets[((t->id + larson_round) % num_threads) *
+                              LARSON_OBJECTS];
+    size_t ops = ops_per_thread / LARSON_ROUNDS;
+    while (t->ops < ops) {
+        size_t slot = next_random(t) % LARSON_OBJECTS;
+        bench_free(t, set[slot]);
+        set[slot] = bench_malloc(t, random_size(t, 16, 1024));
+    }
+}
+
+//===----------------------------------------------------------------------===//
+//                                 Driver
+//===----------------------------------------------------------------------===//
+
+// Reset the peak resident set size of the process (Linux 4.0 and newer)
+static void reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, "5", 1) != 1) {
+        perror("clear_refs");
+    }
+    close(fd);
+}
+
+static long peak_rss_kib(void) {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status == NULL) {
+        return -1;
+    }
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %ld kB", &rss) == 1) {
+            break;
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void *run_thread(void *arg) {
+    Thread *t = arg;
+    t->fn(t);
+    return NULL;
+}
+
+typedef struct Result {
+    size_t ops;
+    size_t fallbacks;
+    uint64_t time_ns;
+    uint64_t *samples;
+    size_t num_samples;
+} Result;
+
+// Run the workload on num_threads threads, and add their numbers to result
+static void run_threads(workload_fn fn, unsigned seed, Result *result) {
+    Thread *threads = calloc(num_threads, sizeof(Thread));
+    for (unsigned i = 0; i < num_threads; i++) {
+        threads[i].fn = fn;
+        threads[i].id = i;
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (seed + i + 1);
+        threads[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, run_thread,
+                           &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    result->time_ns += now_ns() - start;
+
+    for (unsigned i = 0; i < num_threads; i++) {
+        Thread *t = &threads[i];
+        result->ops += t->ops;
+        result->fallbacks += t->fallbacks;
+        result->samples =
+            realloc(result->samples, (result->num_samples + t->num_samples) *
+                                         sizeof(uint64_t));
+        memcpy(result->samples + result->num_samples, t->samples,
+               t->num_samples * sizeof(uint64_t));
+        result->num_samples += t->num_samples;
+        free(t->samples);
+    }
+    free(threads);
+}
+
+static void report(const char *name, Result *result, long rss) {
+    uint64_t p99 = 0;
+    if (result->num_samples > 0) {
+        qsort(result->samples, result->num_samples, sizeof(uint64_t),
+              compare_samples);
+        p99 = result->samples[result->num_samples * 99 / 100];
+    }
+    printf("%-16s %8s %7u %14.0f %10lu %14ld %10zu\n", name, ALLOCATOR,
+           num_threads, result->ops * 1e9 / result->time_ns,
+           (unsigned long)p99, rss, result->fallbacks);
+    free(result->samples);
+}
+
+static void run_simple(const char *name, workload_fn fn) {
+    Result result = {0};
+    reset_peak_rss();
+    run_threads(fn, 0, &result);
+    report(name, &result, peak_rss_kib());
+}
+
+static void run_sweep(void) {
+    static const size_t sizes[] = {16,   24,   32,   48,   64,    96,
+                                   128,  192,  256,  512,  1024,  2048,
+                                   4096, 8192, 16384, 65536, 262144};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "sizes/%zu", sizes[i]);
+        sweep_size = sizes[i];
+        run_simple(name, sweep);
+    }
+}
+
+static void run_producer_consumer(void) {
+    unsigned threads = num_threads;
+    // Producers and consumers come in pairs
+    num_threads = threads < 2 ? 2 : threads & ~1U;
+    rings = calloc(num_threads / 2, sizeof(Ring));
+    run_simple("xthread", producer_consumer);
+    free(rings);
+    num_threads = threads;
+}
+
+static void run_realloc_growth(void) {
+    run_simple("realloc", realloc_growth);
+}
+
+static void run_aligned(void) { run_simple("aligned", aligned); }
+
+static void run_larson(void) {
+    larson_sets = malloc(num_threads * LARSON_OBJECTS * sizeof(void *));
+    Thread init = {.rng = 42};
+    for (size_t i = 0; i < num_threads * LARSON_OBJECTS; i++) {
+        larson_sets[i] = malloc(random_size(&init, 16, 1024));
+    }
+
+    Result result = {0};
+    reset_peak_rss();
+    for (larson_round = 0; larson_round < LARSON_ROUNDS; larson_round++) {
+        run_threads(larson, larson_round * num_threads, &result);
+    }
+    report("larson", &result, peak_rss_kib());
+
+    for (size_t i = 0; i < num_threads * LARSON_OBJECTS; i++) {
+        free(larson_sets[i]);
+    }
+    free(larson_sets);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} workloads[] = {
+    {"sizes", run_sweep},
+    {"xthread", run_producer_consumer},
+    {"realloc", run_realloc_growth},
+    {"aligned", run_aligned},
+    {"larson", run_larson},
+};
+
+int main(int argc, char **argv) {
+    const char *selected = argc > 1 ? argv[1] : "all";
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = argc > 2 ? (unsigned)atoi(argv[2]) : (cpus > 0 ? cpus : 1);
+    if (argc > 3) {
+        ops_per_thread = strtoull(argv[3], NULL, 10);
+    }
+    if (num_threads == 0 || ops_per_thread < LARSON_ROUNDS) {
+        fprintf(stderr, "Usage: %s [workload|all] [threads] [operations]\n",
+                argv[0]);
+        return 1;
+    }
+
+    printf("%-16s %8s %7s %14s %10s %14s %10s\n", "workload", "alloc",
+           "threads", "ops/s", "p99 [ns]", "peak RSS [KiB]", "fallbacks");
+    int found = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(selected, "all") != 0 &&
+            strcmp(selected, workloads[i].name) != 0) {
+            continue;
+        }
+        found = 1;
+        workloads[i].run();
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown workload %s\n", selected);
+        return 1;
+    }
+    return 0;
+}
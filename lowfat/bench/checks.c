@@ -0,0 +1,236 @@
+// Microbenchmark for the checks of the two ways to determine base and size,
+// built once with the run-time compiled for MIRT_LF_TABLE (bench_checks_table)
+// and once for MIRT_LF_COMPUTED_SIZE (bench_checks_computed).
+//
+// Every check is measured for several mixes of witnesses:
+//  - fat: low-fat allocations of one size
+//  - fat-sizes: low-fat allocations of random sizes
+//  - non-fat: allocations outside of the low-fat regions
+//  - mixed-sorted: half low-fat, half non-fat, in two blocks (predictable)
+//  - mixed-random: half low-fat, half non-fat, shuffled (unpredictable)
+// With hot tables, the SIZES and MAGICS entries stay cached, and the checks are
+// timed as a whole. With cold tables, the entries of the witness are flushed
+// from the cache before every check, and every check is timed on its own (the
+// computed variant flushes unused lines instead, such that both pay the same).
+// The time of the same loop without any check is subtracted in both cases.
+//
+// Usage: bench_checks_{table,computed} [repetitions]
+
+#include "LFSizes.h"
+#include "core.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#if MIRT_LF_TABLE
+#define VARIANT "table"
+#else
+#define VARIANT "computed"
+#endif
+
+// Number of (witness, pointer) pairs a run cycles through
+#define NUM_PAIRS 4096
+// Bytes accessed by the dereference checks
+#define ACCESS_SIZE 8
+#define NON_FAT_SIZE (64 << 20)
+
+typedef enum { HOT, COLD } TableState;
+
+typedef struct Pairs {
+    void *witnesses[NUM_PAIRS];
+    void *ptrs[NUM_PAIRS];
+    // The cache lines flushed before the check of every pair in cold runs
+    const void *lines[NUM_PAIRS][2];
+} Pairs;
+
+static char *non_fat;
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+static volatile uintptr_t sink;
+
+#if !MIRT_LF_TABLE
+// Lines flushed by the computed variant, which does not have tables
+static char unused_lines[2][64] __attribute__((aligned(64)));
+#endif
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void set_pair(Pairs *pairs, size_t i, int fat, size_t size) {
+    char *base;
+    if (fat) {
+        base = malloc(size);
+        if (!__is_lowfat(base)) {
+            fprintf(stderr, "Allocation of %zu bytes is not low-fat\n", size);
+            exit(1);
+        }
+    } else {
+        base = non_fat + (next_random() % (NON_FAT_SIZE - size));
+    }
+    pairs->witnesses[i] = base;
+    pairs->ptrs[i] = base + next_random() % (size - ACCESS_SIZE + 1);
+
+#if MIRT_LF_TABLE
+    uint64_t index = __lowfat_ptr_index(base);
+    pairs->lines[i][0] = &((uint64_t *)SIZES_ADDRESS)[index];
+    pairs->lines[i][1] = &((uint64_t *)MAGICS_ADDRESS)[index];
+#else
+    pairs->lines[i][0] = unused_lines[0];
+    pairs->lines[i][1] = unused_lines[1];
+#endif
+}
+
+static size_t random_alloc_size(void) {
+    return ACCESS_SIZE + next_random() % 4096;
+}
+
+static void init_fat(Pairs *pairs) {
+    for (size_t i = 0; i < NUM_PAIRS; i++) {
+        set_pair(pairs, i, 1, 64);
+    }
+}
+
+static void init_fat_sizes(Pairs *pairs) {
+    for (size_t i = 0; i < NUM_PAIRS; i++) {
+        set_pair(pairs, i, 1, random_alloc_size());
+    }
+}
+
+static void init_non_fat(Pairs *pairs) {
+    for (size_t i = 0; i < NUM_PAIRS; i++) {
+        set_pair(pairs, i, 0, random_alloc_size());
+    }
+}
+
+static void init_mixed_sorted(Pairs *pairs) {
+    for (size_t i = 0; i < NUM_PAIRS; i++) {
+        set_pair(pairs, i, i < NUM_PAIRS / 2, random_alloc_size());
+    }
+}
+
+static void init_mixed_random(Pairs *pairs) {
+    for (size_t i = 0; i < NUM_PAIRS; i++) {
+        set_pair(pairs, i, next_random() % 2, random_alloc_size());
+    }
+}
+
+static void flush(const void *line0, const void *line1) {
+#ifdef __x86_64__
+    __builtin_ia32_clflush(line0);
+    __builtin_ia32_clflush(line1);
+    // Wait for the flushes to finish before the check starts
+    __builtin_ia32_mfence();
+#else
+    (void)line0;
+    (void)line1;
+#endif
+}
+
+typedef enum { CHECK_DEREF, CHECK_OOB, GET_UPPER_BOUND, NO_CHECK } Check;
+
+static const char *check_names[] = {"check_deref", "check_oob",
+                                    "get_upper_bound"};
+
+static void perform(Pairs *pairs, size_t i, Check check) {
+    switch (check) {
+    case CHECK_DEREF:
+        __lowfat_check_deref(pairs->witnesses[i], pairs->ptrs[i], ACCESS_SIZE);
+        break;
+    case CHECK_OOB:
+        __lowfat_check_oob(pairs->witnesses[i], pairs->ptrs[i]);
+        break;
+    case GET_UPPER_BOUND:
+        sink = (uintptr_t)__lowfat_get_upper_bound(pairs->ptrs[i]);
+        break;
+    case NO_CHECK:
+        sink = (uintptr_t)pairs->ptrs[i];
+        break;
+    }
+}
+
+// Nanoseconds for `repetitions` runs over all pairs
+static uint64_t run(Pairs *pairs, Check check, TableState tables,
+                    unsigned repetitions) {
+    if (tables == HOT) {
+        uint64_t start = now_ns();
+        for (unsigned r = 0; r < repetitions; r++) {
+            for (size_t i = 0; i < NUM_PAIRS; i++) {
+                perform(pairs, i, check);
+            }
+        }
+        return now_ns() - start;
+    }
+
+    uint64_t time = 0;
+    for (unsigned r = 0; r < repetitions; r++) {
+        for (size_t i = 0; i < NUM_PAIRS; i++) {
+            flush(pairs->lines[i][0], pairs->lines[i][1]);
+            uint64_t start = now_ns();
+            perform(pairs, i, check);
+            time += now_ns() - start;
+        }
+    }
+    return time;
+}
+
+static const struct {
+    const char *name;
+    void (*init)(Pairs *);
+} mixes[] = {
+    {"fat", init_fat},
+    {"fat-sizes", init_fat_sizes},
+    {"non-fat", init_non_fat},
+    {"mixed-sorted", init_mixed_sorted},
+    {"mixed-random", init_mixed_random},
+};
+
+int main(int argc, char **argv) {
+    unsigned repetitions = argc > 1 ? (unsigned)atoi(argv[1]) : 1000;
+    if (repetitions == 0) {
+        fprintf(stderr, "Usage: %s [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    non_fat = mmap(NULL, NON_FAT_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (non_fat == MAP_FAILED || __is_lowfat(non_fat)) {
+        fprintf(stderr, "Could not map the non-fat memory\n");
+        return 1;
+    }
+
+    Pairs *pairs = malloc(sizeof(Pairs));
+    printf("%-10s %-14s %-6s %-16s %10s\n", "variant", "mix", "tables",
+           "check", "ns/check");
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        mixes[m].init(pairs);
+        for (TableState tables = HOT; tables <= COLD; tables++) {
+            // The loop and (for cold tables) the flushes without any check
+            run(pairs, NO_CHECK, tables, 1);
+            uint64_t baseline = run(pairs, NO_CHECK, tables, repetitions);
+            for (Check check = CHECK_DEREF; check < NO_CHECK; check++) {
+                // Warm up the caches and branch predictors
+                run(pairs, check, tables, 1);
+                uint64_t time = run(pairs, check, tables, repetitions);
+                double per_check = ((double)time - (double)baseline) /
+                                   ((double)repetitions * NUM_PAIRS);
+                printf("%-10s %-14s %-6s %-16s %10.2f\n", VARIANT,
+                       mixes[m].name, tables == HOT ? "hot" : "cold",
+                       check_names[check], per_check);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Microbenchmark for the cost of page faults in the kinds of mappings the
+// low-fat regions can use. It touches every page of a fresh anonymous mapping
+// once (first-touch faults), and writes to every page of a populated mapping
+// from a forked child (copy-on-write faults for private mappings).
+//
+// Usage: bench_page_faults [size in MiB] [repetitions]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t page_size;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *map(size_t size, int flags) {
+    char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_NORESERVE | flags, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return mem;
+}
+
+static void touch(char *mem, size_t size) {
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        ((volatile char *)mem)[offset] = 1;
+    }
+}
+
+// Nanoseconds per page to fault in a fresh mapping
+static double first_touch(size_t size, int flags) {
+    char *mem = map(size, flags);
+    uint64_t start = now_ns();
+    touch(mem, size);
+    uint64_t end = now_ns();
+    munmap(mem, size);
+    return (double)(end - start) / (size / page_size);
+}
+
+// Nanoseconds per page for a forked child to write a populated mapping. The
+// result is sent through a pipe, and the parent checks whether it observes the
+// writes of the child.
+static double write_after_fork(size_t size, int flags, int *shared) {
+    char *mem = map(size, flags);
+    touch(mem, size);
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        uint64_t start = now_ns();
+        for (size_t offset = 0; offset < size; offset += page_size) {
+            ((volatile char *)mem)[offset] = 2;
+        }
+        double per_page = (double)(now_ns() - start) / (size / page_size);
+        if (write(fds[1], &per_page, sizeof(per_page)) != sizeof(per_page)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    double per_page = 0;
+    if (read(fds[0], &per_page, sizeof(per_page)) != sizeof(per_page)) {
+        fprintf(stderr, "Failed to read the result of the child\n");
+        exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    *shared = mem[0] == 2;
+    munmap(mem, size);
+    return per_page;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) : 256) << 20;
+    unsigned repetitions = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+    page_size = sysconf(_SC_PAGESIZE);
+
+    struct {
+        const char *name;
+        int flags;
+    } kinds[] = {
+        {"MAP_SHARED", MAP_SHARED},
+        {"MAP_PRIVATE", MAP_PRIVATE},
+    };
+
+    printf("%zu MiB, %u repetitions, best ns/page\n", size >> 20,
+           repetitions);
+    printf("%-12s %12s %12s  %s\n", "mapping", "first touch", "after fork",
+           "child writes visible");
+    for (unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        double best_touch = 0, best_fork = 0;
+        int shared = 0;
+        for (unsigned r = 0; r < repetitions; r++) {
+            double t = first_touch(size, kinds[k].flags);
+            double f = write_after_fork(size, kinds[k].flags, &shared);
+            if (r == 0 || t < best_touch) {
+                best_touch = t;
+            }
+            if (r == 0 || f < best_fork) {
+                best_fork = f;
+            }
+        }
+        printf("%-12s %12.1f %12.1f  %s\n", kinds[k].name, best_touch,
+               best_fork, shared ? "yes" : "no");
+    }
+    return 0;
+}
@@ -10,6 +10,14 @@ import subprocess
 from decimal import Decimal
 from pathlib import Path
 
+OPTIONAL_DEFINITIONS = {"HEAP_CLASSES_PER_POWER_OF_TWO": Decimal(1),
+                        "HEAP_OVERFLOW_BANKS": Decimal(0)}
+
+# Huge page policies for the heap regions, see HEAP_HUGE_PAGES in the README
+HUGE_PAGE_POLICIES = {"none": Decimal(0),
+                      "thp": Decimal(1),
+                      "hugetlb": Decimal(2)}
+
 REQUIRED_DEFINTIONS = ["HEAP_REGION_SIZE",
                        "GLOBAL_REGION_SIZE",
                        "STACK_REGION_SIZE",
@@ -34,6 +42,10 @@ def verify_completeness(config, verbose):
             print(f"Missing required variable in config file: {variable}")
             sys.exit(1)
 
+    for variable, default in OPTIONAL_DEFINITIONS.items():
+        if not variable in config:
+            config[variable] = default
+
     if verbose:
         print("All variables found.")
 
@@ -173,13 +185,192 @@ def get_offsets(min_size, max_size, number_of_regions, region_size):
     return get_values_for_index(min_size, max_size, func)
 
 
-def generate_sizes_header_and_add_derived_vars(config_dict, out_file, verbose):
+def add_sub_power_of_two_classes(config_dict, verbose):
+    """
+    Compute the heap size classes in between two powers of two. Every power of
+    two interval (2^(k-1), 2^k] is split into HEAP_CLASSES_PER_POWER_OF_TWO
+    equally sized steps. The additional classes are placed in their own regions
+    after the stack region. They only contain a heap part.
+    Returns the sizes of the additional classes in ascending order.
+    """
+    classes = to_int(config_dict["HEAP_CLASSES_PER_POWER_OF_TWO"])
+    if classes < 1 or classes & (classes - 1):
+        print("HEAP_CLASSES_PER_POWER_OF_TWO must be a power of two.")
+        sys.exit(1)
+    classes_log = int(math.log2(classes))
+
+    # Every class has to be a multiple of 16 to keep the malloc alignment
+    # guarantees, i.e. the step within (2^(k-1), 2^k] must be at least 16.
+    min_log = max(int(decimal_log_2(config_dict["MIN_ALLOC_SIZE"])) + 1,
+                  5 + classes_log)
+    # The base computation for these classes is only exact if the offset of a
+    # pointer in its region times the class size fits into 64 bit.
+    max_log = min(int(decimal_log_2(config_dict["MAX_HEAP_ALLOC_SIZE"])),
+                  63 - int(config_dict["REGION_SIZE_LOG"]))
+    if classes == 1 or min_log > max_log:
+        min_log = 0
+        max_log = 0
+
+    sizes = []
+    if max_log:
+        for k in range(min_log, max_log + 1):
+            step = 2**(k - 1 - classes_log)
+            for j in range(1, classes):
+                sizes.append(2**(k - 1) + j * step)
+
+    if verbose:
+        print(f"Additional heap allocation sizes: {sizes}")
+
+    config_dict["SUB_REGION_CLASSES_LOG"] = Decimal(classes_log)
+    config_dict["SUB_REGION_MIN_LOG"] = Decimal(min_log)
+    config_dict["SUB_REGION_MAX_LOG"] = Decimal(max_log)
+    config_dict["NUM_SUB_REGIONS"] = Decimal(len(sizes))
+    config_dict["SUB_REGIONS_BASE_NUM"] = config_dict["BASE_STACK_REGION_NUM"] + 1
+    config_dict["NUM_HEAP_CLASSES"] = config_dict["NUM_REGIONS"] + \
+        config_dict["NUM_SUB_REGIONS"]
+
+    return sizes
+
+
+def add_overflow_banks(config_dict, verbose):
+    """
+    Place HEAP_OVERFLOW_BANKS additional regions for every heap size class,
+    which are used once the primary region of the class is full. Every bank
+    holds one region per class. The regions of the classes in between two
+    powers of two directly follow the primary ones, such that all regions whose
+    base requires a multiplication are contiguous. The regions of the power of
+    two classes follow after them. They only contain a heap part.
+    """
+    banks = to_int(config_dict["HEAP_OVERFLOW_BANKS"])
+    if banks < 0:
+        print("HEAP_OVERFLOW_BANKS must not be negative.")
+        sys.exit(1)
+
+    config_dict["OVERFLOW_REGIONS_BASE_NUM"] = \
+        config_dict["SUB_REGIONS_BASE_NUM"] + \
+        config_dict["NUM_SUB_REGIONS"] * (banks + 1)
+    config_dict["NUM_HEAP_REGIONS"] = \
+        config_dict["NUM_HEAP_CLASSES"] * (banks + 1)
+
+    end = config_dict["OVERFLOW_REGIONS_BASE_NUM"] + \
+        config_dict["NUM_REGIONS"] * banks
+    if end * config_dict["REGION_SIZE"] > config_dict["MAXIMAL_ADDRESS"]:
+        print(f"The {banks} overflow banks do not fit below MAXIMAL_ADDRESS, "
+              f"use less HEAP_OVERFLOW_BANKS.")
+        sys.exit(1)
+
+    if verbose and banks:
+        print(f"Overflow banks: {banks}, last region index: {end - 1}")
+
+
+def parse_profile_file(profile_file, headroom, min_region_size, verbose):
+    """
+    Parse the allocation profile written by a run-time built with
+    MIRT_LF_PROFILE. Returns a dictionary mapping every profiled allocation
+    size to the heap region size it requires.
+    """
+    with open(profile_file, 'r') as file_content:
+        profile = json.load(file_content, parse_int=Decimal,
+                            parse_float=Decimal)
+
+    # The regions of a size in all overflow banks are accounted together.
+    # Fall-back allocations would have been placed in the region as well if it
+    # was large enough.
+    used_by_size = {}
+    for region in profile["regions"]:
+        used = region["used_bytes"] + region["fallbacks"] * region["size"]
+        used_by_size[region["size"]] = \
+            used_by_size.get(region["size"], Decimal(0)) + used
+
+    # Round up to huge pages, such that regions are page aligned on every
+    # system.
+    granularity = Decimal(2 * 1024 * 1024)
+    needs = {}
+    for size, used in used_by_size.items():
+        need = max(used * headroom, min_region_size, size)
+        need = (need / granularity).to_integral_value(
+            rounding="ROUND_CEILING") * granularity
+        needs[size] = need
+        if verbose:
+            print(f"Profiled size {size}: used {used}B, reserving {need}B")
+
+    return needs
+
+
+def fit_heap_region_size(config_dict, region_needs, verbose):
+    """
+    Grow the heap part of every region if the profile requires more space than
+    configured. The size of a whole region has to stay a power of two.
+    """
+    largest_need = max(region_needs.values())
+    if largest_need <= config_dict["HEAP_REGION_SIZE"]:
+        return
+
+    others = config_dict["GLOBAL_REGION_SIZE"] + \
+        config_dict["STACK_REGION_SIZE"]
+    region_size = Decimal(2**math.ceil(math.log2(largest_need + others)))
+    config_dict["HEAP_REGION_SIZE"] = region_size - others
+    if verbose:
+        print(f"Grow HEAP_REGION_SIZE to {config_dict['HEAP_REGION_SIZE']}")
+
+
+def get_heap_region_sizes(config_dict, heap_sizes, region_needs,
+                          min_region_size):
+    """
+    Compute the size of the heap part of every region. Without a profile,
+    every region uses HEAP_REGION_SIZE. With a profile, every region gets the
+    space the profile requires, sizes that were not profiled get the minimal
+    region size (but at least space for one allocation).
+    """
+    if region_needs is None:
+        return [to_int(config_dict["HEAP_REGION_SIZE"])] * len(heap_sizes)
+
+    result = []
+    for size in heap_sizes:
+        default = min(max(min_region_size, Decimal(size)),
+                      config_dict["HEAP_REGION_SIZE"])
+        result.append(to_int(region_needs.get(Decimal(size), default)))
+    return result
+
+
+def get_heap_huge_page_policies(config_dict, heap_sizes):
+    """
+    Determine the huge page policy of every heap region. The optional
+    HEAP_HUGE_PAGES entry maps allocation sizes to policies, all other regions
+    use normal pages.
+    The entry is removed from the config, as it is not a plain number.
+    """
+    policies = config_dict.pop("HEAP_HUGE_PAGES", {})
+    for size, policy in policies.items():
+        if policy not in HUGE_PAGE_POLICIES:
+            print(f"Unknown huge page policy '{policy}' for size {size}, "
+                  f"expected one of {list(HUGE_PAGE_POLICIES)}.")
+            sys.exit(1)
+        if Decimal(size) not in heap_sizes:
+            print(f"HEAP_HUGE_PAGES contains {size}, which is not a heap "
+                  f"allocation size.")
+            sys.exit(1)
+
+    for name, value in HUGE_PAGE_POLICIES.items():
+        config_dict[f"HUGE_PAGES_{name.upper()}"] = value
+
+    by_size = {Decimal(size): policy for size, policy in policies.items()}
+    return [HUGE_PAGE_POLICIES[by_size.get(Decimal(size), "none")]
+            for size in heap_sizes]
+
+
+def generate_sizes_header_and_add_derived_vars(config_dict, out_file,
+                                               region_needs, min_region_size,
+                                               verbose):
     """
     Generate the header file containing the sizes for the low fat regions and
     derived values.
     """
     verify_completeness(config_dict, verbose)
 
+    if region_needs:
+        fit_heap_region_size(config_dict, region_needs, verbose)
+
     # Define the offsets for heap/stack/globals within each region
     config_dict["HEAP_REGION_OFFSET"] = Decimal(0)
     config_dict["GLOBAL_REGION_OFFSET"] = config_dict["HEAP_REGION_OFFSET"] + \
@@ -209,6 +400,19 @@ def generate_sizes_header_and_add_derived_vars(config_dict, out_file, verbose):
     # Place the stack after the other regions
     config_dict["BASE_STACK_REGION_NUM"] = config_dict["NUM_REGIONS"] + 1
 
+    sub_region_sizes = add_sub_power_of_two_classes(config_dict, verbose)
+    add_overflow_banks(config_dict, verbose)
+    heap_region_sizes = get_heap_region_sizes(config_dict,
+                                              pows_two + sub_region_sizes,
+                                              region_needs, min_region_size)
+    heap_huge_pages = get_heap_huge_page_policies(config_dict,
+                                                  pows_two + sub_region_sizes)
+    # The overflow banks repeat the classes, and with them the settings of
+    # their regions
+    banks = to_int(config_dict["HEAP_OVERFLOW_BANKS"]) + 1
+    heap_region_sizes *= banks
+    heap_huge_pages *= banks
+
     unsigned_type = "uint64_t"
     signed_type = "int64_t"
     min_size = to_int(config_dict["MIN_ALLOC_SIZE"])
@@ -239,6 +443,17 @@ def generate_sizes_header_and_add_derived_vars(config_dict, out_file, verbose):
     # Write the arrays
     with open(out_file, "a") as open_file:
         open_file.write(f"\n{sizes}\n{masks}\n{offsets}")
+        region_sizes = get_array("HEAP_REGION_SIZES", unsigned_type,
+                                 heap_region_sizes)
+        open_file.write(f"\n{region_sizes}")
+        huge_pages = get_array("HEAP_REGION_HUGE_PAGES", "uint8_t",
+                               heap_huge_pages)
+        open_file.write(f"\n{huge_pages}")
+        # Zero-sized arrays are not valid C
+        if sub_region_sizes:
+            sub_sizes = get_array("SUB_REGION_SIZES", unsigned_type,
+                                  sub_region_sizes)
+            open_file.write(f"\n{sub_sizes}")
 
 
 def bytes_to_gib(bytes_value):
@@ -439,7 +654,7 @@ def generate_lto_linker_script(config_dict, linker_script_name, verbose):
 
 def generate_sizes_header_and_linker_script(config_file, sizes_path,
                                             script_path, lto_script_path,
-                                            verbose):
+                                            profile_args, verbose):
     """
     Generate the header file for C/C++ with the configured sizes.
     Additionally generate a linker script for correctly placing global variables
@@ -447,8 +662,15 @@ def generate_sizes_header_and_linker_script(config_file, sizes_path,
     """
     config_dict = parse_config_file(config_file, verbose)
 
+    region_needs = None
+    min_region_size = Decimal(profile_args.profile_min_region_size)
+    if profile_args.profile:
+        region_needs = parse_profile_file(profile_args.profile,
+                                          Decimal(profile_args.profile_headroom),
+                                          min_region_size, verbose)
+
     generate_sizes_header_and_add_derived_vars(
-        config_dict, sizes_path, verbose)
+        config_dict, sizes_path, region_needs, min_region_size, verbose)
 
     if script_path:
         generate_linker_script(config_dict, script_path, verbose)
@@ -475,6 +697,17 @@ def main():
                         help='The path of the generated linker script file.')
     parser.add_argument('--lto-scriptname', type=Path,
                         help='The path of the generated linker script file.')
+    parser.add_argument('--profile', type=Path,
+                        help='Allocation profile (written by a run-time built '
+                             'with MIRT_LF_PROFILE) used to size every heap '
+                             'region individually.')
+    parser.add_argument('--profile-headroom', type=float, default=2,
+                        help='Factor by which the heap regions are larger than '
+                             'the space used in the profile.')
+    parser.add_argument('--profile-min-region-size', type=int,
+                        default=64*1024*1024,
+                        help='Size of the heap regions that the profile does '
+                             'not require more space for.')
     parser.add_argument('-v', '--verbose',
                         action='store_true', help='Verbose output')
     args = parser.parse_args()
@@ -487,8 +720,13 @@ def main():
 
     args.sizes.parent.mkdir(parents=True, exist_ok=True)
 
+    if args.profile and not args.profile.exists():
+        print(f"Profile file '{args.profile}' does not exist.")
+        sys.exit(1)
+
     generate_sizes_header_and_linker_script(
-        args.config, args.sizes, args.scriptname, args.lto_scriptname, args.verbose)
+        args.config, args.sizes, args.scriptname, args.lto_scriptname, args,
+        args.verbose)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,238 @@
+#include "core.h"
+
+#include "LFSizes.h"
+#include "lowfat_defines.h"
+
+#if defined(__x86_64__) && !defined(MIRT_STATISTICS)
+#define LF_BATCH_AVX2 1
+#include <immintrin.h>
+#else
+// Statistics count every check individually, so they use the scalar checks
+#define LF_BATCH_AVX2 0
+#endif
+
+// The batch checks perform the checks of core.h for n (witness, ptr, size)
+// triples. With AVX2, four triples are checked at once. If any of them fails
+// (or needs a computation that is not vectorized), the four triples are
+// checked again with the scalar checks, which report the error.
+
+static void check_deref_scalar(void *const *witnesses, void *const *ptrs,
+                               const size_t *sizes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __lowfat_check_deref(witnesses[i], ptrs[i], sizes[i]);
+    }
+}
+
+static void check_deref_inner_witness_scalar(void *const *witnesses,
+                                             void *const *ptrs,
+                                             const size_t *sizes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __lowfat_check_deref_inner_witness(witnesses[i], ptrs[i], sizes[i]);
+    }
+}
+
+static void check_oob_scalar(void *const *witnesses, void *const *ptrs,
+                             size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __lowfat_check_oob(witnesses[i], ptrs[i]);
+    }
+}
+
+#if LF_BATCH_AVX2
+
+#define LANES 4
+
+#define AVX2 __attribute__((__target__("avx2"), __always_inline__))
+
+static int use_avx2(void) {
+    // Threads racing to initialize this store the same value
+    static int supported = -1;
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") != 0;
+    }
+    return supported;
+}
+
+static AVX2 __m256i load(const void *values) {
+    return _mm256_loadu_si256((const __m256i *)values);
+}
+
+// Unsigned a > b, AVX2 only compares signed values
+static AVX2 __m256i greater_unsigned(__m256i a, __m256i b) {
+    __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(a, sign),
+                              _mm256_xor_si256(b, sign));
+}
+
+#if MIRT_LF_TABLE
+
+static AVX2 __m256i region_indices(__m256i witnesses) {
+    return _mm256_srli_epi64(witnesses, REGION_SIZE_LOG);
+}
+
+static AVX2 __m256i allocation_sizes(__m256i indices) {
+    return _mm256_i64gather_epi64((const long long *)SIZES_ADDRESS, indices,
+                                  sizeof(uint64_t));
+}
+
+// Lanes whose base cannot be computed with allocation_bases are set in the
+// returned mask
+static AVX2 __m256i unsupported_bases(__m256i indices) {
+#if NUM_SUB_REGIONS > 0
+    // The bases of the classes in between two powers of two require a 128 bit
+    // multiplication
+    __m256i sub_indices =
+        _mm256_sub_epi64(indices, _mm256_set1_epi64x(SUB_REGIONS_BASE_NUM));
+    return greater_unsigned(
+        _mm256_set1_epi64x(NUM_SUB_REGIONS * (HEAP_OVERFLOW_BANKS + 1)),
+        sub_indices);
+#else
+    (void)indices;
+    return _mm256_setzero_si256();
+#endif
+}
+
+static AVX2 __m256i allocation_bases(__m256i witnesses, __m256i indices) {
+    return _mm256_and_si256(
+        witnesses, _mm256_i64gather_epi64((const long long *)MAGICS_ADDRESS,
+                                          indices, sizeof(uint64_t)));
+}
+
+#else
+
+static AVX2 __m256i region_indices(__m256i witnesses) {
+    return _mm256_sub_epi64(_mm256_srli_epi64(witnesses, REGION_SIZE_LOG),
+                            _mm256_set1_epi64x(1));
+}
+
+static AVX2 __m256i non_fat(__m256i indices) {
+    return greater_unsigned(indices, _mm256_set1_epi64x(NUM_REGIONS - 1));
+}
+
+// The scalar checks skip non-fat witnesses, they get the widest bounds here
+static AVX2 __m256i allocation_sizes(__m256i indices) {
+    return _mm256_or_si256(
+        _mm256_sllv_epi64(_mm256_set1_epi64x(MIN_ALLOC_SIZE), indices),
+        non_fat(indices));
+}
+
+static AVX2 __m256i unsupported_bases(__m256i indices) {
+    (void)indices;
+    return _mm256_setzero_si256();
+}
+
+static AVX2 __m256i allocation_bases(__m256i witnesses, __m256i indices) {
+    __m256i masks = _mm256_sllv_epi64(
+        _mm256_set1_epi64x(-1),
+        _mm256_add_epi64(indices, _mm256_set1_epi64x(MIN_ALLOC_SIZE_LOG)));
+    return _mm256_andnot_si256(non_fat(indices),
+                               _mm256_and_si256(witnesses, masks));
+}
+
+#endif
+
+// The lanes for which ptr - base > alloc_size - size, i.e. the size-byte
+// access to ptr exceeds the allocation
+static AVX2 __m256i out_of_bounds(__m256i ptrs, __m256i alloc_bases,
+                                  __m256i alloc_sizes, __m256i sizes) {
+    __m256i violations =
+        greater_unsigned(_mm256_sub_epi64(ptrs, alloc_bases),
+                         _mm256_sub_epi64(alloc_sizes, sizes));
+#ifdef MIRT_REPORT_PTR_OVERFLOW
+    violations =
+        _mm256_or_si256(violations, greater_unsigned(sizes, alloc_sizes));
+#endif
+    return violations;
+}
+
+static __attribute__((__target__("avx2"))) void
+check_deref_avx2(void *const *witnesses, void *const *ptrs,
+                 const size_t *sizes, size_t n) {
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        // The witnesses point to the base of their allocation
+        __m256i witness = load(witnesses + i);
+        __m256i violations =
+            out_of_bounds(load(ptrs + i), witness,
+                          allocation_sizes(region_indices(witness)),
+                          load(sizes + i));
+        if (!_mm256_testz_si256(violations, violations)) {
+            check_deref_scalar(witnesses + i, ptrs + i, sizes + i, LANES);
+        }
+    }
+    check_deref_scalar(witnesses + i, ptrs + i, sizes + i, n - i);
+}
+
+static __attribute__((__target__("avx2"))) void
+check_deref_inner_witness_avx2(void *const *witnesses, void *const *ptrs,
+                               const size_t *sizes, size_t n) {
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        __m256i witness = load(witnesses + i);
+        __m256i indices = region_indices(witness);
+        __m256i violations = _mm256_or_si256(
+            unsupported_bases(indices),
+            out_of_bounds(load(ptrs + i), allocation_bases(witness, indices),
+                          allocation_sizes(indices), load(sizes + i)));
+        if (!_mm256_testz_si256(violations, violations)) {
+            check_deref_inner_witness_scalar(witnesses + i, ptrs + i,
+                                             sizes + i, LANES);
+        }
+    }
+    check_deref_inner_witness_scalar(witnesses + i, ptrs + i, sizes + i,
+                                     n - i);
+}
+
+static __attribute__((__target__("avx2"))) void
+check_oob_avx2(void *const *witnesses, void *const *ptrs, size_t n) {
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        __m256i witness = load(witnesses + i);
+        __m256i indices = region_indices(witness);
+        __m256i violations = _mm256_or_si256(
+            unsupported_bases(indices),
+            out_of_bounds(load(ptrs + i), allocation_bases(witness, indices),
+                          allocation_sizes(indices), _mm256_set1_epi64x(1)));
+        if (!_mm256_testz_si256(violations, violations)) {
+            check_oob_scalar(witnesses + i, ptrs + i, LANES);
+        }
+    }
+    check_oob_scalar(witnesses + i, ptrs + i, n - i);
+}
+
+#endif
+
+void __lowfat_check_deref_batch(void *const *witnesses, void *const *ptrs,
+                                const size_t *sizes, size_t n) {
+#if LF_BATCH_AVX2
+    if (use_avx2()) {
+        check_deref_avx2(witnesses, ptrs, sizes, n);
+        return;
+    }
+#endif
+    check_deref_scalar(witnesses, ptrs, sizes, n);
+}
+
+void __lowfat_check_deref_inner_witness_batch(void *const *witnesses,
+                                              void *const *ptrs,
+                                              const size_t *sizes, size_t n) {
+#if LF_BATCH_AVX2
+    if (use_avx2()) {
+        check_deref_inner_witness_avx2(witnesses, ptrs, sizes, n);
+        return;
+    }
+#endif
+    check_deref_inner_witness_scalar(witnesses, ptrs, sizes, n);
+}
+
+void __lowfat_check_oob_batch(void *const *witnesses, void *const *ptrs,
+                              size_t n) {
+#if LF_BATCH_AVX2
+    if (use_avx2()) {
+        check_oob_avx2(witnesses, ptrs, n);
+        return;
+    }
+#endif
+    check_oob_scalar(witnesses, ptrs, n);
+}
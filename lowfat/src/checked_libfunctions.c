@@ -0,0 +1,79 @@
+#include "core.h"
+
+#include "LFSizes.h"
+#include "fail_function.h"
+#include "statistics.h"
+
+#include <string.h>
+
+// The checked variants of the libc memory and string functions check every
+// accessed range once, and then call the optimized libc routine. A range is in
+// bounds if it lies within the allocation its first byte belongs to. Ranges of
+// non-fat pointers are not checked.
+
+// Determine the number of bytes from ptr to the end of the allocation it points
+// into, or SIZE_MAX if ptr is not low-fat.
+static __attribute__((__always_inline__)) size_t bytes_left(const void *ptr) {
+    if (!__is_lowfat((void *)ptr)) {
+        return SIZE_MAX;
+    }
+    uint64_t index = __lowfat_ptr_index((void *)ptr);
+    return __lowfat_ptr_base((void *)ptr, index) + __lowfat_ptr_size(index) -
+           (uintptr_t)ptr;
+}
+
+static __attribute__((__always_inline__)) void
+check_range(const void *ptr, size_t size, const char *msg) {
+    STAT_INC(NumLibFunctionChecks);
+    if (size > bytes_left(ptr)) {
+        __mi_debug_printf("Error with\n\tPtr:\t%p, base %p, size %u, "
+                          "accessed %u\n",
+                          ptr, __lowfat_get_lower_bound((void *)ptr),
+                          __lowfat_ptr_size(__lowfat_ptr_index((void *)ptr)),
+                          size);
+        __mi_fail_with_msg(msg);
+    }
+}
+
+// Determine the length of the string at src, but do not read beyond its
+// allocation or beyond max bytes.
+static __attribute__((__always_inline__)) size_t
+bounded_strlen(const char *src, size_t max) {
+    size_t left = bytes_left(src);
+    return strnlen(src, max < left ? max : left);
+}
+
+void *__lowfat_memcpy(void *dest, const void *src, size_t n) {
+    check_range(dest, n, "Out-of-bounds memcpy destination!\n");
+    check_range(src, n, "Out-of-bounds memcpy source!\n");
+    return memcpy(dest, src, n);
+}
+
+void *__lowfat_memmove(void *dest, const void *src, size_t n) {
+    check_range(dest, n, "Out-of-bounds memmove destination!\n");
+    check_range(src, n, "Out-of-bounds memmove source!\n");
+    return memmove(dest, src, n);
+}
+
+void *__lowfat_memset(void *dest, int c, size_t n) {
+    check_range(dest, n, "Out-of-bounds memset!\n");
+    return memset(dest, c, n);
+}
+
+char *__lowfat_strcpy(char *dest, const char *src) {
+    // Copy the string including its terminator, which has to be part of the
+    // allocation of src
+    size_t n = bounded_strlen(src, SIZE_MAX) + 1;
+    check_range(src, n, "Out-of-bounds strcpy source!\n");
+    check_range(dest, n, "Out-of-bounds strcpy destination!\n");
+    return memcpy(dest, src, n);
+}
+
+char *__lowfat_strncpy(char *dest, const char *src, size_t n) {
+    // strncpy reads src up to its terminator, but at most n bytes, and always
+    // writes n bytes to dest
+    size_t read = bounded_strlen(src, n) + 1;
+    check_range(src, read < n ? read : n, "Out-of-bounds strncpy source!\n");
+    check_range(dest, n, "Out-of-bounds strncpy destination!\n");
+    return strncpy(dest, src, n);
+}
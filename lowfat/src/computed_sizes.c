@@ -6,6 +6,14 @@
 
 #if MIRT_LF_COMPUTED_SIZE
 
+static_assert(NUM_SUB_REGIONS == 0,
+              "Computing sizes requires all sizes to be powers of two, use the "
+              "table-based configuration for HEAP_CLASSES_PER_POWER_OF_TWO.");
+
+static_assert(HEAP_OVERFLOW_BANKS == 0,
+              "Computing sizes requires one region per size, use the "
+              "table-based configuration for HEAP_OVERFLOW_BANKS.");
+
 //===------------------- Determine Base/Index/Size ------------------------===//
 
 uint64_t __lowfat_ptr_index(void *ptr) {
@@ -50,6 +58,14 @@ int __is_lowfat(void *ptr) {
 
 uint64_t __lowfat_get_zero_based_index(uint64_t index) { return index; }
 
+uint64_t __lowfat_size_for_zero_based_index(uint64_t zero_based_index) {
+    return __lowfat_ptr_size(zero_based_index);
+}
+
+uintptr_t __lowfat_heap_region_base(uint64_t zero_based_index) {
+    return (zero_based_index + 1) * REGION_SIZE + HEAP_REGION_OFFSET;
+}
+
 //===----------------------------- Checks ---------------------------------===//
 
 void __lowfat_check_deref(void *witness_base, void *ptr, size_t size) {
@@ -2,6 +2,9 @@
 
 #define MIRT_STATS_COUNTER_DEFS "statistic_counters.def"
 
+/// Print the per-region statistics after the counters.
+#define MIRT_STATS_EXTRA_PRINTER __lowfat_print_region_stats
+
 /// If defined, use this key to find a file to print runtime stats to.
 // #define STATS_FILE_ENV "MIRT_STATS_FILE"
 
@@ -66,6 +66,16 @@ void __lowfat_check_deref_inner_witness(void *witness, void *ptr,
 // allocation as witness.
 void __lowfat_check_oob(void *witness, void *ptr) __CHECK_ATTRIBUTES;
 
+// Perform the above checks for n (witness, ptr, size) triples, given as
+// arrays. Checks four triples at once if the CPU supports AVX2.
+void __lowfat_check_deref_batch(void *const *witnesses, void *const *ptrs,
+                                const size_t *sizes, size_t n);
+void __lowfat_check_deref_inner_witness_batch(void *const *witnesses,
+                                              void *const *ptrs,
+                                              const size_t *sizes, size_t n);
+void __lowfat_check_oob_batch(void *const *witnesses, void *const *ptrs,
+                              size_t n);
+
 //===----------------------------------------------------------------------===//
 //                              Explicit Bounds
 //===----------------------------------------------------------------------===//
@@ -75,6 +85,33 @@ void __lowfat_check_oob(void *witness, void *ptr) __CHECK_ATTRIBUTES;
 void *__lowfat_get_lower_bound(void *ptr) __INTERNAL_FUNCTIONS_ATTRIBUTES;
 void *__lowfat_get_upper_bound(void *ptr) __INTERNAL_FUNCTIONS_ATTRIBUTES;
 
+//===----------------------------------------------------------------------===//
+//                          Checked libc Functions
+//===----------------------------------------------------------------------===//
+
+// Variants of the libc functions that check every range they access once, and
+// fail if it exceeds the allocation it starts in. They return the same as the
+// libc functions.
+void *__lowfat_memcpy(void *dest, const void *src, size_t n);
+void *__lowfat_memmove(void *dest, const void *src, size_t n);
+void *__lowfat_memset(void *dest, int c, size_t n);
+char *__lowfat_strcpy(char *dest, const char *src);
+char *__lowfat_strncpy(char *dest, const char *src, size_t n);
+
+//===----------------------------------------------------------------------===//
+//                             Batch Allocation
+//===----------------------------------------------------------------------===//
+
+// Allocate n objects of the given size, and store them in out. Takes the lock
+// of the size class once for all of them. Objects that do not fit into the
+// low-fat regions are taken from the fall-back allocator. Returns the number of
+// stored objects, which is less than n only if the fall-back allocator fails.
+size_t __lowfat_malloc_batch(size_t size, size_t n, void **out);
+
+// Free the n objects in ptrs (NULL entries are skipped). Consecutive objects of
+// the same size class are freed under one lock.
+void __lowfat_free_batch(void *const *ptrs, size_t n);
+
 //===----------------------------------------------------------------------===//
 //                                  Utils
 //===----------------------------------------------------------------------===//
@@ -86,6 +123,16 @@ void *__lowfat_get_upper_bound(void *ptr) __INTERNAL_FUNCTIONS_ATTRIBUTES;
 uint64_t
 __lowfat_get_zero_based_index(uint64_t index) __INTERNAL_FUNCTIONS_ATTRIBUTES;
 
+// Determine the size of the objects allocated in the region with the given
+// zero-based index.
+uint64_t __lowfat_size_for_zero_based_index(uint64_t zero_based_index)
+    __INTERNAL_FUNCTIONS_ATTRIBUTES;
+
+// Determine the start address of the heap part of the region with the given
+// zero-based index.
+uintptr_t __lowfat_heap_region_base(uint64_t zero_based_index)
+    __INTERNAL_FUNCTIONS_ATTRIBUTES;
+
 // Determine whether the given value is `alignment` aligned.
 // Returns 1 if value is a multiple of alignment, and 0 otherwise.
 int __lowfat_is_aligned(uint64_t value,
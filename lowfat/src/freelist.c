@@ -2,72 +2,308 @@
 
 #include "LFSizes.h"
 #include "core.h"
+#include "fail_function.h"
+#include "lowfat_defines.h"
 #include "statistics.h"
 
-#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
 #include <sys/mman.h>
 
 extern uint64_t __lowfat_page_size;
 
-// represents an element in a free list
-typedef struct Element {
-    void *addr;
-    struct Element *prev;
-} Element;
+// The huge page policy every region was actually mapped with
+extern uint8_t __lowfat_heap_region_huge_pages[NUM_HEAP_REGIONS];
 
-// current top elements for every free list
-static Element *__lowfat_free_list_tops[NUM_REGIONS];
+static_assert(HEAP_REGION_SIZE / 4096 <= UINT32_MAX,
+              "Slots of page-multiple size classes are tracked with 32 bit "
+              "slot numbers, which cannot address all slots of a heap region "
+              "of the configured HEAP_REGION_SIZE.");
 
-void __lowfat_free_list_push(unsigned index, void *addr) {
-    Element *current_top = __lowfat_free_list_tops[index];
+// The free slots of every region are bucketed by their natural alignment, i.e.
+// bucket b holds the slots whose slot number (relative to the region base) has
+// b trailing zeros. As region bases are aligned to REGION_SIZE, a slot in
+// bucket b is aligned to 2^b times the largest power of two dividing the
+// allocation size of the region, but only up to REGION_SIZE. Slot zero is kept
+// in the last bucket.
+#define NUM_ALIGNMENT_BUCKETS (REGION_SIZE_LOG - MIN_ALLOC_SIZE_LOG + 1)
+
+static_assert(NUM_ALIGNMENT_BUCKETS <= 64,
+              "The non-empty buckets of a region are tracked in a 64 bit "
+              "mask.");
+
+typedef struct FreeList {
+    // Free slots of size classes that are not a multiple of the page size are
+    // chained through their first word, which always fits as every slot is at
+    // least MIN_ALLOC_SIZE bytes large. This is the current top slot.
+    void *top;
+    // Slots of page-multiple size classes might be decommitted while they are
+    // on the free list, so they cannot hold a link. Their slot numbers are
+    // kept on a separate stack instead, which is mmaped on first use.
+    uint32_t *slots;
+    // Number of elements in the free list
+    size_t length;
+    // Number of elements at the bottom of the slot stack whose memory has
+    // already been returned to the OS. All elements above are still committed.
+    size_t decommitted;
+} FreeList;
+
+static FreeList __lowfat_free_lists[NUM_HEAP_REGIONS][NUM_ALIGNMENT_BUCKETS];
+
+// One bit for every bucket of a region, set iff the bucket is not empty
+static uint64_t __lowfat_free_list_non_empty[NUM_HEAP_REGIONS];
+
+// The bucket the last slot of every region was pushed to. Unaligned requests
+// are served from it, such that recently freed slots are reused first.
+static unsigned __lowfat_free_list_last_bucket[NUM_HEAP_REGIONS];
+
+// Number of committed slots on the free lists of page-multiple regions
+static size_t __lowfat_free_list_committed[NUM_HEAP_REGIONS];
+
+// Slots of hugetlb regions are never decommitted, as this is only possible for
+// whole huge pages. They are treated like slots smaller than a page.
+static int is_page_multiple(unsigned index, size_t allocation_size) {
+    return __lowfat_heap_region_huge_pages[index] != HUGE_PAGES_HUGETLB &&
+           __lowfat_is_aligned(allocation_size, __lowfat_page_size);
+}
+
+static unsigned bucket_for_slot(uint64_t slot) {
+    if (slot == 0) {
+        return NUM_ALIGNMENT_BUCKETS - 1;
+    }
+    unsigned bucket = __builtin_ctzll(slot);
+    return bucket < NUM_ALIGNMENT_BUCKETS ? bucket : NUM_ALIGNMENT_BUCKETS - 1;
+}
+
+static uint32_t *get_slot_stack(unsigned index, unsigned bucket,
+                                size_t allocation_size) {
+    FreeList *list = &__lowfat_free_lists[index][bucket];
+    if (list->slots != NULL) {
+        return list->slots;
+    }
+
+    // Reserve enough space to hold every slot of the region that belongs to
+    // this bucket, the stack is only physically backed as far as it actually
+    // grows.
+    size_t capacity = ((HEAP_REGION_SIZE / allocation_size) >> bucket) + 1;
+    void *slots = mmap(NULL, capacity * sizeof(uint32_t),
+                       PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (slots == MAP_FAILED) {
+        __mi_printf("[Free list] Could not mmap the slot stack for region "
+                    "%u: %s\n",
+                    index, strerror(errno));
+        __mi_fail();
+    }
+    list->slots = slots;
+    return slots;
+}
+
+static void *slot_address(unsigned index, uint64_t slot,
+                          size_t allocation_size) {
+    return (void *)(__lowfat_heap_region_base(index) + slot * allocation_size);
+}
+
+static void sift_down_slot(uint32_t *slots, size_t root, size_t end) {
+    while (2 * root + 1 < end) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < end && slots[child] < slots[child + 1]) {
+            child++;
+        }
+        if (slots[root] >= slots[child]) {
+            return;
+        }
+        uint32_t temp = slots[root];
+        slots[root] = slots[child];
+        slots[child] = temp;
+        root = child;
+    }
+}
+
+// Heap sort, as qsort might allocate memory while the region lock is held
+static void sort_slots(uint32_t *slots, size_t n) {
+    for (size_t i = n / 2; i > 0; i--) {
+        sift_down_slot(slots, i - 1, n);
+    }
+    for (size_t end = n; end > 1; end--) {
+        uint32_t temp = slots[0];
+        slots[0] = slots[end - 1];
+        slots[end - 1] = temp;
+        sift_down_slot(slots, 0, end - 1);
+    }
+}
+
+static void decommit_slot_range(unsigned index, uint64_t first_slot,
+                                size_t num_slots, size_t allocation_size) {
+    void *addr = slot_address(index, first_slot, allocation_size);
+    if (madvise(addr, num_slots * allocation_size, MADV_DONTNEED) < 0) {
+        __mi_debug_printf("Failed to decommit %p: %s\n", addr,
+                          strerror(errno));
+    }
+}
 
-    // Allocate a new element container for the free list.
-    // We disable increments of stat counters for this to not mess up our
-    // counts for non-low-fat mallocs.
-    // Note: These allocations might introduce overhead that could be reduced.
-    __mi_disable_stats();
-    Element *new_top = malloc(sizeof(Element));
-    __mi_enable_stats();
+// Return the memory of all committed slots on the free lists of the region to
+// the OS. The slots stay mapped readable and writable, so they can be reused
+// without any further system call. The slots of all buckets are sorted, such
+// that neighboring slots are returned with a single madvise.
+static void decommit_free_slots(unsigned index, size_t allocation_size) {
+    size_t committed = __lowfat_free_list_committed[index];
+    size_t sorted_size = committed * sizeof(uint32_t);
+    uint32_t *sorted = mmap(NULL, sorted_size, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (sorted == MAP_FAILED) {
+        sorted = NULL;
+    }
+
+    size_t num_sorted = 0;
+    for (unsigned bucket = 0; bucket < NUM_ALIGNMENT_BUCKETS; bucket++) {
+        FreeList *list = &__lowfat_free_lists[index][bucket];
+        for (size_t i = list->decommitted; i < list->length; i++) {
+            if (sorted != NULL && num_sorted < committed) {
+                sorted[num_sorted++] = list->slots[i];
+            } else {
+                // No memory to sort the slots, return them one by one
+                decommit_slot_range(index, list->slots[i], 1,
+                                    allocation_size);
+            }
+            STAT_INC(NumDecommittedSlots);
+        }
+        list->decommitted = list->length;
+    }
+
+    if (sorted != NULL) {
+        sort_slots(sorted, num_sorted);
+        size_t run_start = 0;
+        for (size_t i = 1; i <= num_sorted; i++) {
+            if (i == num_sorted || sorted[i] != sorted[i - 1] + 1) {
+                decommit_slot_range(index, sorted[run_start], i - run_start,
+                                    allocation_size);
+                STAT_INC(NumDecommitRanges);
+                run_start = i;
+            }
+        }
+        munmap(sorted, sorted_size);
+    }
+
+    __lowfat_free_list_committed[index] = 0;
+    STAT_INC(NumDecommitBatches);
+}
 
-    new_top->addr = addr;
-    new_top->prev = current_top;
+static void push_slot(unsigned index, void *addr, int is_fresh) {
+    size_t allocation_size = __lowfat_size_for_zero_based_index(index);
+    uint64_t slot =
+        ((uintptr_t)addr - __lowfat_heap_region_base(index)) / allocation_size;
+    unsigned bucket = bucket_for_slot(slot);
+    FreeList *list = &__lowfat_free_lists[index][bucket];
 
-    __lowfat_free_list_tops[index] = new_top;
+    __lowfat_free_list_non_empty[index] |= 1ULL << bucket;
+    __lowfat_free_list_last_bucket[index] = bucket;
+
+    if (!is_page_multiple(index, allocation_size)) {
+        *(void **)addr = list->top;
+        list->top = addr;
+        list->length++;
+        return;
+    }
+
+    uint32_t *slots = get_slot_stack(index, bucket, allocation_size);
+    if (is_fresh) {
+        // The slot was never touched, so it is zero just like a decommitted
+        // one. Keep it below the watermark by moving the lowest committed slot
+        // to the top instead.
+        slots[list->length++] = slots[list->decommitted];
+        slots[list->decommitted++] = slot;
+        return;
+    }
+    slots[list->length++] = slot;
 
     // if the allocation size of the freed address is a multiple of page size we
     // can return the physical space to the OS for any other size it would not
-    // be feasible to track when memory could be returned
-    size_t allocation_size = __lowfat_ptr_size(index);
-    if (__lowfat_is_aligned(allocation_size, __lowfat_page_size)) {
-        munmap(addr, allocation_size);
-        // remap the space again as we might reuse it
-        // NOTE: This does not PHYSICALLY use space yet
-        mmap(addr, allocation_size, PROT_NONE,
-             MAP_ANONYMOUS | MAP_SHARED | MAP_NORESERVE, -1, 0);
+    // be feasible to track when memory could be returned. This is deferred
+    // until enough memory piled up, such that quickly reused slots do not pay
+    // for any system calls.
+    __lowfat_free_list_committed[index]++;
+    if (__lowfat_free_list_committed[index] * allocation_size >
+        MIRT_LF_DECOMMIT_THRESHOLD) {
+        decommit_free_slots(index, allocation_size);
     }
 }
 
-void *__lowfat_free_list_pop(unsigned index) {
-    Element *current_top = __lowfat_free_list_tops[index];
+void __lowfat_free_list_push(unsigned index, void *addr) {
+    push_slot(index, addr, 0);
+}
 
-    if (current_top != NULL) {
-        __lowfat_free_list_tops[index] = current_top->prev;
-        void *addr = current_top->addr;
-        free(current_top);
+void __lowfat_free_list_push_fresh(unsigned index, void *addr) {
+    push_slot(index, addr, 1);
+}
 
-        // if the allocation size of a freed allocation is a multiple of page
-        // size, its memory was re-mmaped after it has been freed and it must be
-        // made readable and writable again
-        size_t allocation_size = __lowfat_ptr_size(index);
-        if (__lowfat_is_aligned(allocation_size, __lowfat_page_size))
-            mprotect(addr, allocation_size, PROT_READ | PROT_WRITE);
+void *__lowfat_free_list_pop(unsigned index, size_t alignment, int *is_zero) {
+    size_t allocation_size = __lowfat_size_for_zero_based_index(index);
 
+    // No slot is known to be aligned to more than REGION_SIZE, even though the
+    // last bucket (with slot zero) stands for larger alignments if the
+    // allocation size has more trailing zeros than MIN_ALLOC_SIZE
+    if (alignment > REGION_SIZE) {
+        return NULL;
+    }
+
+    // Determine the smallest bucket whose slots fulfill the alignment
+    unsigned min_bucket = 0;
+    unsigned size_alignment_log = __builtin_ctzll(allocation_size);
+    if (alignment > (1ULL << size_alignment_log)) {
+        min_bucket = __builtin_ctzll(alignment) - size_alignment_log;
+        if (min_bucket >= NUM_ALIGNMENT_BUCKETS) {
+            return NULL;
+        }
+    }
+
+    uint64_t candidates =
+        __lowfat_free_list_non_empty[index] & (UINT64_MAX << min_bucket);
+    if (candidates == 0) {
+        return NULL;
+    }
+
+    // Prefer the most recently used bucket, otherwise take the least aligned
+    // one to keep well aligned slots for requests that need them.
+    unsigned bucket = __lowfat_free_list_last_bucket[index];
+    if (!(candidates & (1ULL << bucket))) {
+        bucket = __builtin_ctzll(candidates);
+    }
+    FreeList *list = &__lowfat_free_lists[index][bucket];
+
+    list->length--;
+    if (list->length == 0) {
+        __lowfat_free_list_non_empty[index] &= ~(1ULL << bucket);
+    }
+
+    if (!is_page_multiple(index, allocation_size)) {
+        void *addr = list->top;
+        list->top = *(void **)addr;
+        *is_zero = 0;
         return addr;
     }
 
-    return NULL;
+    if (list->decommitted > list->length) {
+        list->decommitted = list->length;
+        // decommitted slots are still mapped readable and writable, the OS
+        // provides fresh (zeroed) pages on the first access
+        *is_zero = 1;
+    } else {
+        __lowfat_free_list_committed[index]--;
+        *is_zero = 0;
+    }
+
+    return slot_address(index, list->slots[list->length], allocation_size);
 }
 
 int __lowfat_free_list_is_empty(unsigned index) {
-    return __lowfat_free_list_tops[index] == NULL;
+    return __lowfat_free_list_non_empty[index] == 0;
+}
+
+size_t __lowfat_free_list_length(unsigned index) {
+    size_t length = 0;
+    for (unsigned bucket = 0; bucket < NUM_ALIGNMENT_BUCKETS; bucket++) {
+        length += __lowfat_free_lists[index][bucket].length;
+    }
+    return length;
 }
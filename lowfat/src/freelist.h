@@ -1,15 +1,32 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 // current implementation works like a stack (insertion and deletion as in LIFO)
+// per alignment bucket, see freelist.c for details
+
+// The free lists do not allocate any memory for their elements, and are not
+// synchronized. Callers have to hold the lock of the region corresponding to
+// index.
 
 // adds an element to the free list for the region corresponding to index
 void __lowfat_free_list_push(unsigned index, void *addr);
 
-// return current top element of the free list for the region corresponding to
-// index if the free list is empty, returns NULL
-void *__lowfat_free_list_pop(unsigned index);
+// adds an element from the fresh space of the region corresponding to index,
+// i.e., one that was never used and is known to be zero
+void __lowfat_free_list_push_fresh(unsigned index, void *addr);
+
+// return a free element for the region corresponding to index, which is aligned
+// to alignment (power of two, or 0 if there is no requirement)
+// is_zero is set to 1 if the memory of the element is known to be zero (as it
+// was returned to the OS or never used), and 0 otherwise
+// if there is no such element, returns NULL
+void *__lowfat_free_list_pop(unsigned index, size_t alignment, int *is_zero);
 
 // return 1 if empty, 0 otherwise
 int __lowfat_free_list_is_empty(unsigned index);
+
+// return the number of elements in the free list for the region corresponding
+// to index
+size_t __lowfat_free_list_length(unsigned index);
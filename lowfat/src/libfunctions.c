@@ -3,12 +3,16 @@
 #include "fail_function.h"
 #include "freelist.h"
 #include "lowfat_defines.h"
+#include "profile.h"
+#include "region_mapping.h"
 #include "statistics.h"
+#include "thread_stacks.h"
 
 #include <errno.h>
-#include <fcntl.h>
 #include <limits.h>
+#include <malloc.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -20,20 +24,33 @@
 // for reading symbols from glibc (not portable)
 #include <dlfcn.h>
 
-// mutex for locking
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Older C libraries do not define it yet
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
+// One lock per region, guarding its fresh space pointer and its free list.
+// Allocations and frees of different sizes do not contend with each other.
+static pthread_mutex_t region_locks[NUM_HEAP_REGIONS] = {
+    [0 ... NUM_HEAP_REGIONS - 1] = PTHREAD_MUTEX_INITIALIZER};
 
 // system-dependent, but often 4KB
 uint64_t __lowfat_page_size;
 
 // pointers pointing to the next free memory space for each region
-static void *regions[NUM_REGIONS];
-static void *stack_regions[NUM_REGIONS];
-
-// Internal structures (i.e. the free list) use the glibc functions for
-// allocating and freeing, as they don't need runtime checks. This flag ensures
-// that behavior. The flag is active by default, so new threads can use the low
-// fat allocator.
+static void *regions[NUM_HEAP_REGIONS];
+// whether each region was mapped already, which happens on the first
+// allocation from its fresh space
+static char regions_mapped[NUM_HEAP_REGIONS];
+// The huge page policy that took effect when each region was mapped. It
+// differs from HEAP_REGION_HUGE_PAGES if the huge page pool was too small or
+// transparent huge pages are disabled.
+uint8_t __lowfat_heap_region_huge_pages[NUM_HEAP_REGIONS];
+
+// Internal allocations (e.g. by dlopen or the statistics) use the glibc
+// functions for allocating and freeing, as they don't need runtime checks. This
+// flag ensures that behavior. The flag is active by default, so new threads can
+// use the low fat allocator.
 _Thread_local static int hooks_active = 1;
 
 typedef int (*start_main_type)(int *(main)(int, char **, char **), int argc,
@@ -75,6 +92,59 @@ static valloc_type valloc_found = NULL;
 typedef void *(*pvalloc_type)(size_t);
 static pvalloc_type pvalloc_found = NULL;
 
+typedef size_t (*malloc_usable_size_type)(void *);
+static malloc_usable_size_type malloc_usable_size_found = NULL;
+
+// Only provided by recent glibc versions, NULL if not available
+#if __GLIBC_PREREQ(2, 33)
+typedef struct mallinfo2 (*mallinfo2_type)(void);
+static mallinfo2_type mallinfo2_found = NULL;
+#endif
+
+typedef void (*free_sized_type)(void *, size_t);
+static free_sized_type free_sized_found = NULL;
+
+typedef void (*free_aligned_sized_type)(void *, size_t, size_t);
+static free_aligned_sized_type free_aligned_sized_found = NULL;
+
+// The pthread functions live in libpthread for older glibc versions, so they
+// are looked up with RTLD_NEXT on first use instead.
+typedef int (*pthread_create_type)(pthread_t *, const pthread_attr_t *,
+                                   void *(*)(void *), void *);
+static pthread_create_type pthread_create_found = NULL;
+
+typedef int (*pthread_join_type)(pthread_t, void **);
+static pthread_join_type pthread_join_found = NULL;
+
+typedef int (*pthread_tryjoin_np_type)(pthread_t, void **);
+static pthread_tryjoin_np_type pthread_tryjoin_np_found = NULL;
+
+typedef int (*pthread_timedjoin_np_type)(pthread_t, void **,
+                                         const struct timespec *);
+static pthread_timedjoin_np_type pthread_timedjoin_np_found = NULL;
+
+typedef int (*pthread_detach_type)(pthread_t);
+static pthread_detach_type pthread_detach_found = NULL;
+
+static void initThreadFunctions(void) {
+    pthread_create_found =
+        (pthread_create_type)dlsym(RTLD_NEXT, "pthread_create");
+    pthread_join_found = (pthread_join_type)dlsym(RTLD_NEXT, "pthread_join");
+    pthread_tryjoin_np_found =
+        (pthread_tryjoin_np_type)dlsym(RTLD_NEXT, "pthread_tryjoin_np");
+    pthread_timedjoin_np_found =
+        (pthread_timedjoin_np_type)dlsym(RTLD_NEXT, "pthread_timedjoin_np");
+    pthread_detach_found =
+        (pthread_detach_type)dlsym(RTLD_NEXT, "pthread_detach");
+    if (!pthread_create_found || !pthread_join_found ||
+        !pthread_tryjoin_np_found || !pthread_timedjoin_np_found ||
+        !pthread_detach_found) {
+        fprintf(stderr, "Meminstrument: Error finding pthread symbols:\n%s\n",
+                dlerror());
+        exit(74);
+    }
+}
+
 void initDynamicFunctions(void) {
     const char *libname = "libc.so.6";
     void *handle = dlopen(libname, RTLD_NOW | RTLD_LOCAL);
@@ -94,89 +164,157 @@ void initDynamicFunctions(void) {
     memalign_found = (memalign_type)dlsym(handle, "memalign");
     valloc_found = (valloc_type)dlsym(handle, "valloc");
     pvalloc_found = (pvalloc_type)dlsym(handle, "pvalloc");
+    malloc_usable_size_found =
+        (malloc_usable_size_type)dlsym(handle, "malloc_usable_size");
 
     if ((msg = dlerror())) {
         fprintf(stderr, "Meminstrument: Error finding libc symbols:\n%s\n",
                 msg);
         exit(74);
     }
+
+    // These are optional, the sized frees fall back to free
+#if __GLIBC_PREREQ(2, 33)
+    mallinfo2_found = (mallinfo2_type)dlsym(handle, "mallinfo2");
+#endif
+    free_sized_found = (free_sized_type)dlsym(handle, "free_sized");
+    free_aligned_sized_found =
+        (free_aligned_sized_type)dlsym(handle, "free_aligned_sized");
+    dlerror();
 }
 
-/**
- * Lowfat allocator
- *
- * @param size the size of the allocation
- * @param alignment alignment requirement for the allocation, must be power of 2
- * (or 0 if there is no requirement)
- * @return lowfat pointer if possible, NULL if not (e.g. because no space left)
- */
-static void *lowfat_aligned_alloc(size_t size, size_t alignment) {
+// The mmap flags for the heap region with the given zero-based index. Heap
+// regions are private mappings, nothing aliases them. This keeps page faults
+// off the shmem path, and gives forked children a copy-on-write heap.
+static int heap_region_flags(unsigned zero_based_index) {
+    if (HEAP_REGION_HUGE_PAGES[zero_based_index] == HUGE_PAGES_HUGETLB) {
+        // Without a reservation, accesses fail with SIGBUS as soon as the huge
+        // page pool is exhausted
+        return MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB;
+    }
+    return MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
+}
 
-    if (size == 0) {
-        STAT_INC(NumSizeZeroAllocs);
-        return NULL;
+// Map the heap region with the given zero-based index, and apply its huge page
+// policy.
+static void map_heap_region(unsigned zero_based_index) {
+    uintptr_t region_base = __lowfat_heap_region_base(zero_based_index);
+    size_t region_size = HEAP_REGION_SIZES[zero_based_index];
+
+    uint8_t policy = HEAP_REGION_HUGE_PAGES[zero_based_index];
+    int flags = heap_region_flags(zero_based_index);
+    int mapped = __lowfat_commit_region(region_base, region_size, flags, -1);
+    if (!mapped && (flags & MAP_HUGETLB)) {
+        policy = HUGE_PAGES_NONE;
+        __mi_printf("LF: Not enough huge pages for the heap region %p (size "
+                    "%lu), using normal pages\n",
+                    (void *)region_base, region_size);
+        mapped = __lowfat_commit_region(region_base, region_size,
+                                        MAP_ANONYMOUS | MAP_PRIVATE |
+                                            MAP_NORESERVE,
+                                        -1);
     }
 
-    // a pointer is allowed to point to the address right after an array, so we
-    // pad the size by 1 to avoid false positives for OOB detection
-    size_t padded_size = size + 1;
+    // Check that mmap mapped the desired addresses (otherwise we might get
+    // false positive later for the safety checks)
+    if (!mapped) {
+        __mi_printf("LF: Failed to mmap the required memory location "
+                    "(heap)!\n\tWanted: %p\n",
+                    (void *)region_base);
+        exit(99);
+    }
 
-    // use fallback allocator for sizes that are too large (-> non low fat
-    // pointer)
-    if (padded_size > MAX_HEAP_ALLOC_SIZE) {
-        STAT_INC(NumTooLargeNonFatAllocs);
-        return NULL;
+    if (policy == HUGE_PAGES_THP &&
+        madvise((void *)region_base, region_size, MADV_HUGEPAGE) < 0) {
+        __mi_debug_printf("Failed to enable huge pages for %p: %s\n",
+                          (void *)region_base, strerror(errno));
+        policy = HUGE_PAGES_NONE;
     }
 
-    unsigned region_index = __lowfat_index_for_size(padded_size);
-    unsigned zero_based_index = __lowfat_get_zero_based_index(region_index);
+    __lowfat_heap_region_huge_pages[zero_based_index] = policy;
+    regions_mapped[zero_based_index] = 1;
+    __mi_debug_printf("Allocated heap region %p (num %d size %lu)\n",
+                      (void *)region_base, zero_based_index, region_size);
+}
 
-    pthread_mutex_lock(&mutex);
+/**
+ * Allocate a slot from the heap region with the given zero-based index, either
+ * from its free list or from its fresh space.
+ *
+ * @param zero_based_index the region to allocate from
+ * @param size the requested size, only used for profiling
+ * @param alignment alignment requirement for the allocation (or 0)
+ * @param is_zero see lowfat_aligned_alloc
+ * @param record_fallback whether to profile a fall-back allocation if the
+ * region is full
+ * @return the slot, or NULL if the region is full
+ */
+static void *region_alloc(unsigned zero_based_index, size_t size,
+                          size_t alignment, int *is_zero,
+                          int record_fallback) {
+    // size is only used for profiling and debug output
+    (void)size;
+    pthread_mutex_t *lock = &region_locks[zero_based_index];
+    pthread_mutex_lock(lock);
 
     // first check free list for corresponding region
-    // if alignment is required this step is omitted as searching the whole free
-    // list for a suitable address might be expensive
-    if (!alignment && !__lowfat_free_list_is_empty(zero_based_index)) {
+    // the free slots are bucketed by their alignment, so this is also cheap for
+    // aligned allocations
+    int free_res_is_zero;
+    void *free_res =
+        __lowfat_free_list_pop(zero_based_index, alignment, &free_res_is_zero);
+    if (free_res != NULL) {
         STAT_INC(NumFreeListPops);
-        void *free_res = __lowfat_free_list_pop(zero_based_index);
-        pthread_mutex_unlock(&mutex);
-        STAT_INC(NumLowFatAllocs);
+        LF_PROFILE(__lowfat_profile_alloc(zero_based_index, size));
+        pthread_mutex_unlock(lock);
+        if (is_zero) {
+            *is_zero = free_res_is_zero;
+        }
         return free_res;
     }
 
-    size_t allocation_size = __lowfat_ptr_size(region_index);
-    __mi_debug_printf("Incoming size: %d\nSize to be allocated: %d\nRegion "
-                      "index: %d\nZero-based region index: %d\n",
-                      size, allocation_size, region_index, zero_based_index);
+    size_t allocation_size =
+        __lowfat_size_for_zero_based_index(zero_based_index);
+    __mi_debug_printf("Incoming size: %d\nSize to be allocated: %d\n"
+                      "Zero-based region index: %d\n",
+                      size, allocation_size, zero_based_index);
+    if (!regions_mapped[zero_based_index]) {
+        map_heap_region(zero_based_index);
+    }
+
+    uintptr_t region_base = __lowfat_heap_region_base(zero_based_index);
     void *res = regions[zero_based_index];
+    uintptr_t region_end = region_base + HEAP_REGION_SIZES[zero_based_index];
 
     // for unaligned allocations this loop finishes in the first iteration
     while (1) {
 
         // check if there is still fresh space left in this region
-        if ((uintptr_t)res >= (zero_based_index + 2) * REGION_SIZE) {
-            STAT_INC(NumFullRegionNonFatAllocs);
-            pthread_mutex_unlock(&mutex);
-            __mi_debug_printf("Region %d is full, using fall-back allocator\n",
-                              region_index);
+        if ((uintptr_t)res + allocation_size > region_end) {
+            if (record_fallback) {
+                LF_PROFILE(__lowfat_profile_fallback(zero_based_index));
+            }
+            pthread_mutex_unlock(lock);
             return NULL;
         }
 
         if (!alignment || __lowfat_is_aligned((uintptr_t)res, alignment)) {
-            // allow read/write on allocated memory (only required for page
-            // aligned addresses)
-            if ((__lowfat_is_aligned((uintptr_t)res, __lowfat_page_size)))
-                mprotect(res, allocation_size, PROT_READ | PROT_WRITE);
-
+            // No need to change the protection of the slot: The heap regions
+            // are mapped readable and writable when they are created, and
+            // freed slots stay that way even when their memory is decommitted.
             regions[zero_based_index] = res + allocation_size;
-            pthread_mutex_unlock(&mutex);
+            LF_PROFILE(__lowfat_profile_alloc(zero_based_index, size));
+            pthread_mutex_unlock(lock);
             __mi_debug_printf("Allocated address: %p\n", res);
-            STAT_INC(NumLowFatAllocs);
+            // fresh space of the anonymous mapping was never touched
+            if (is_zero) {
+                *is_zero = 1;
+            }
             return res;
         }
 
         // space is not aligned, add it to the free list
-        __lowfat_free_list_push(zero_based_index, res);
+        __lowfat_free_list_push_fresh(zero_based_index, res);
         STAT_INC(NumNonAlignedFreeListAdds);
 
         // check next fresh space slot
@@ -184,16 +322,218 @@ static void *lowfat_aligned_alloc(size_t size, size_t alignment) {
     }
 }
 
-static void *lowfat_alloc(size_t size) { return lowfat_aligned_alloc(size, 0); }
+/**
+ * Allocate up to n slots from the heap region with the given zero-based index
+ * while holding its lock once. Free slots are reused first, the rest is carved
+ * from fresh space in one step.
+ *
+ * @param zero_based_index the region to allocate from
+ * @param size the requested size, only used for profiling
+ * @param out the array to store the slots in
+ * @param n the number of slots to allocate
+ * @param record_fallback whether to profile the allocations that did not fit
+ * into the region anymore
+ * @return the number of slots stored in out
+ */
+static size_t region_alloc_batch(unsigned zero_based_index, size_t size,
+                                 void **out, size_t n, int record_fallback) {
+    // size is only used for profiling
+    (void)size;
+    pthread_mutex_t *lock = &region_locks[zero_based_index];
+    pthread_mutex_lock(lock);
+
+    size_t count = 0;
+    int is_zero;
+    while (count < n) {
+        void *slot = __lowfat_free_list_pop(zero_based_index, 0, &is_zero);
+        if (slot == NULL) {
+            break;
+        }
+        STAT_INC(NumFreeListPops);
+        LF_PROFILE(__lowfat_profile_alloc(zero_based_index, size));
+        out[count++] = slot;
+    }
+
+    if (count < n) {
+        if (!regions_mapped[zero_based_index]) {
+            map_heap_region(zero_based_index);
+        }
+
+        size_t allocation_size =
+            __lowfat_size_for_zero_based_index(zero_based_index);
+        uintptr_t region_end = __lowfat_heap_region_base(zero_based_index) +
+                               HEAP_REGION_SIZES[zero_based_index];
+        void *res = regions[zero_based_index];
+        size_t fresh = (region_end - (uintptr_t)res) / allocation_size;
+        if (fresh > n - count) {
+            fresh = n - count;
+        }
+        for (size_t i = 0; i < fresh; i++) {
+            LF_PROFILE(__lowfat_profile_alloc(zero_based_index, size));
+            out[count++] = res;
+            res += allocation_size;
+        }
+        regions[zero_based_index] = res;
+
+        if (record_fallback) {
+            for (size_t i = count; i < n; i++) {
+                LF_PROFILE(__lowfat_profile_fallback(zero_based_index));
+            }
+        }
+    }
+
+    pthread_mutex_unlock(lock);
+    return count;
+}
+
+/**
+ * Determine the heap size class for allocations of the given size.
+ *
+ * @param size the size of the allocation
+ * @param zero_based_index set to the zero-based index of the primary region of
+ * the size class
+ * @return 1 if the allocation can be low-fat, 0 if it has to use the fall-back
+ * allocator
+ */
+static int heap_class_for_size(size_t size, unsigned *zero_based_index) {
+    if (size == 0) {
+        STAT_INC(NumSizeZeroAllocs);
+        return 0;
+    }
+
+    // a pointer is allowed to point to the address right after an array, so we
+    // pad the size by 1 to avoid false positives for OOB detection
+    size_t padded_size = size + 1;
+
+    // use fallback allocator for sizes that are too large (-> non low fat
+    // pointer)
+    if (padded_size > MAX_HEAP_ALLOC_SIZE) {
+        STAT_INC(NumTooLargeNonFatAllocs);
+        return 0;
+    }
+
+    *zero_based_index =
+        __lowfat_get_zero_based_index(__lowfat_index_for_size(padded_size));
+    return 1;
+}
+
+/**
+ * Lowfat allocator
+ *
+ * @param size the size of the allocation
+ * @param alignment alignment requirement for the allocation, must be power of 2
+ * (or 0 if there is no requirement)
+ * @param is_zero if not NULL, set to 1 if the memory of the allocation is known
+ * to be zero (it was never used or returned to the OS since), and 0 otherwise
+ * @return lowfat pointer if possible, NULL if not (e.g. because no space left)
+ */
+static void *lowfat_aligned_alloc(size_t size, size_t alignment,
+                                  int *is_zero) {
+    unsigned zero_based_index;
+    if (!heap_class_for_size(size, &zero_based_index)) {
+        return NULL;
+    }
+
+    // Slots are only known to be aligned up to REGION_SIZE, looking for a
+    // larger alignment would push every fresh slot of the region onto its free
+    // list. Leave these to the fall-back allocator.
+    if (alignment > REGION_SIZE) {
+        return NULL;
+    }
+
+    // Once the region of the size is full, the regions of the same size in the
+    // overflow banks are used in order. Slots freed in an earlier bank are
+    // preferred over fresh space of a later one.
+    for (unsigned bank = 0; bank <= HEAP_OVERFLOW_BANKS; bank++) {
+        void *res =
+            region_alloc(zero_based_index + bank * NUM_HEAP_CLASSES, size,
+                         alignment, is_zero, bank == HEAP_OVERFLOW_BANKS);
+        if (res != NULL) {
+            STAT_INC(NumLowFatAllocs);
+            if (bank > 0) {
+                STAT_INC(NumOverflowBankAllocs);
+            }
+            return res;
+        }
+    }
+
+    STAT_INC(NumFullRegionNonFatAllocs);
+    __mi_debug_printf("Region %d is full, using fall-back allocator\n",
+                      zero_based_index);
+    return NULL;
+}
+
+static void *lowfat_alloc(size_t size) {
+    return lowfat_aligned_alloc(size, 0, NULL);
+}
+
+/**
+ * Move the contents of a low-fat allocation to another low-fat allocation.
+ *
+ * Large allocations are moved by remapping their pages instead of copying
+ * them. src keeps its mapping with fresh pages, such that it can be put on the
+ * free list afterwards.
+ *
+ * @param dst the new allocation
+ * @param src the old allocation, its contents are undefined afterwards
+ * @param size the number of bytes to move
+ */
+static void lowfat_move(void *dst, void *src, size_t size) {
+    unsigned src_index = __lowfat_get_zero_based_index(__lowfat_ptr_index(src));
+    unsigned dst_index = __lowfat_get_zero_based_index(__lowfat_ptr_index(dst));
+    size_t page_bytes = size & ~(__lowfat_page_size - 1);
+    // Moved pages keep the kind of their mapping and its huge page advice, so
+    // only move them between regions with the same huge page policy. Pages of
+    // hugetlb regions can only be remapped as a whole.
+    if (page_bytes < MIRT_LF_MREMAP_THRESHOLD ||
+        __lowfat_heap_region_huge_pages[src_index] !=
+            __lowfat_heap_region_huge_pages[dst_index] ||
+        __lowfat_heap_region_huge_pages[src_index] == HUGE_PAGES_HUGETLB ||
+        !__lowfat_is_aligned((uintptr_t)src, __lowfat_page_size) ||
+        !__lowfat_is_aligned((uintptr_t)dst, __lowfat_page_size)) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    // Kernels before 5.7 do not know MREMAP_DONTUNMAP, only try it once
+    static int dontunmap_unsupported = 0;
+    if (__atomic_load_n(&dontunmap_unsupported, __ATOMIC_RELAXED)) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    // The remaining bytes that do not fill a whole page are copied, this has to
+    // happen before the pages of src are moved.
+    memcpy(dst + page_bytes, src + page_bytes, size - page_bytes);
+
+    // With MREMAP_DONTUNMAP, src stays mapped and provides fresh (zeroed) pages
+    // on the next access. The address range of src is never unmapped, so no
+    // concurrent mmap of another thread can be placed in it.
+    void *moved =
+        mremap(src, page_bytes, page_bytes,
+               MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, dst);
+    if (moved != dst) {
+        __mi_debug_printf("Failed to move %p to %p: %s\n", src, dst,
+                          strerror(errno));
+        if (errno == EINVAL) {
+            __atomic_store_n(&dontunmap_unsupported, 1, __ATOMIC_RELAXED);
+        }
+        memcpy(dst, src, page_bytes);
+        return;
+    }
+    STAT_INC(NumMremapReallocs);
+}
 
 static void internal_free(void *p) {
     // add freed address to free list for corresponding region
     if (__is_lowfat(p)) {
-        pthread_mutex_lock(&mutex);
+        unsigned zero_based_index =
+            __lowfat_get_zero_based_index(__lowfat_ptr_index(p));
+        pthread_mutex_lock(&region_locks[zero_based_index]);
         STAT_INC(NumLowFatFrees);
-        __lowfat_free_list_push(
-            __lowfat_get_zero_based_index(__lowfat_ptr_index(p)), p);
-        pthread_mutex_unlock(&mutex);
+        LF_PROFILE(__lowfat_profile_free(zero_based_index));
+        __lowfat_free_list_push(zero_based_index, p);
+        pthread_mutex_unlock(&region_locks[zero_based_index]);
     } else
         free_found(p);
 }
@@ -234,11 +574,16 @@ void *calloc(size_t nmemb, size_t size) {
         STAT_INC(NumOverflowingCallocs);
         res = calloc_found(nmemb, size);
     } else {
-        res = lowfat_alloc(total_size);
-        if (res != NULL)
-            memset(res, 0, total_size);
-        else
+        int is_zero;
+        res = lowfat_aligned_alloc(total_size, 0, &is_zero);
+        if (res == NULL) {
             res = calloc_found(nmemb, size);
+        } else if (is_zero) {
+            // Do not touch the pages of memory that is zero anyway
+            STAT_INC(NumZeroCallocs);
+        } else {
+            memset(res, 0, total_size);
+        }
     }
 
     hooks_active = 1;
@@ -259,10 +604,11 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
-    // otherwise we have 3 cases:
+    // otherwise we have 4 cases:
 
+    // 0. ptr is low fat and the new size maps to the same region -> ptr
     // 1. ptr is low fat and the new one will be low fat as well -> our
-    // malloc, copy, our free
+    // malloc, copy (or move the pages for large sizes), our free
     // 2. ptr is low fat but the new one is not (size too big)   -> glibc
     // malloc, copy, our free Note: copy and free are only done if the
     // allocation succeeded (i.e. errno is 0)
@@ -274,6 +620,17 @@ void *realloc(void *ptr, size_t size) {
     hooks_active = 0;
     void *res = NULL;
     if (__is_lowfat(ptr)) {
+        uint64_t old_index = __lowfat_ptr_index(ptr);
+        // Compare the sizes instead of the indices, ptr might be in an
+        // overflow bank
+        if (size != 0 && size < MAX_HEAP_ALLOC_SIZE &&
+            __lowfat_ptr_size(__lowfat_index_for_size(size + 1)) ==
+                __lowfat_ptr_size(old_index)) {
+            STAT_INC(NumInPlaceReallocs);
+            hooks_active = 1;
+            return ptr; // case 0
+        }
+
         res = lowfat_alloc(size); // case 1
 
         if (res == NULL)
@@ -281,9 +638,12 @@ void *realloc(void *ptr, size_t size) {
                 size); // case 2 (or lowfat_alloc wasn't successful)
 
         if (res != NULL) {
-            size_t old_size = __lowfat_ptr_size(__lowfat_ptr_index(ptr));
+            size_t old_size = __lowfat_ptr_size(old_index);
             size_t copy_size = old_size < size ? old_size : size;
-            memcpy(res, ptr, copy_size);
+            if (__is_lowfat(res))
+                lowfat_move(res, ptr, copy_size);
+            else
+                memcpy(res, ptr, copy_size);
             internal_free(ptr);
         }
     } else {
@@ -311,9 +671,7 @@ void *aligned_alloc(size_t alignment, size_t size) {
         errno = EINVAL;
         res = NULL;
     } else {
-        // since size must be a multiple of alignment here, we can simply
-        // use the normal allocation routine
-        res = lowfat_alloc(size);
+        res = lowfat_aligned_alloc(size, alignment, NULL);
         if (res == NULL) {
             res = aligned_alloc_found(alignment, size);
         }
@@ -341,7 +699,7 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
         STAT_INC(NumNonPowTwoAllocs);
         err_status = EINVAL;
     } else {
-        res = lowfat_aligned_alloc(size, alignment);
+        res = lowfat_aligned_alloc(size, alignment, NULL);
 
         if (res == NULL) {
             err_status = posix_memalign(memptr, alignment, size);
@@ -370,7 +728,7 @@ void *memalign(size_t alignment, size_t size) {
         errno = EINVAL;
         res = NULL;
     } else {
-        res = lowfat_aligned_alloc(size, alignment);
+        res = lowfat_aligned_alloc(size, alignment, NULL);
         if (res == NULL) {
             res = memalign_found(alignment, size);
         }
@@ -391,7 +749,7 @@ void *valloc(size_t size) {
     hooks_active = 0;
     void *res;
 
-    res = lowfat_aligned_alloc(size, __lowfat_page_size);
+    res = lowfat_aligned_alloc(size, __lowfat_page_size, NULL);
     if (res == NULL) {
         res = valloc_found(size);
     }
@@ -413,7 +771,7 @@ void *pvalloc(size_t size) {
 
     size_t rounded_size =
         (size + __lowfat_page_size - 1) & ~(__lowfat_page_size - 1);
-    res = lowfat_alloc(rounded_size);
+    res = lowfat_aligned_alloc(rounded_size, __lowfat_page_size, NULL);
     if (res == NULL) {
         res = pvalloc_found(size);
     }
@@ -439,57 +797,396 @@ void free(void *p) {
     return;
 }
 
-// Create a file descriptor to a file with the given name and size.
-static int __lowfat_create_file(char *name, size_t size) {
-
-    // Generate a full path containing the given name
-    char *start = "/dev/shm/lf.";
-    // Use the process/thread id to avoid conflicts with other instances running
-    // in parallel.
-    pid_t current_pid = getpid();
-    pid_t current_tid = gettid();
-    // snprintf with NULL+0 determines the length of the string result as if it
-    // would have been printed some output buffer.
-    int pid_length = snprintf(NULL, 0, "%d", current_pid);
-    int tid_length = snprintf(NULL, 0, "%d", current_tid);
-    char *ending = ".tmp";
-    // Create the full path: all parts, plus two dots and the NUL terminator
-    size_t full_length = strlen(start) + strlen(name) + 1 + pid_length + 1 +
-                         tid_length + strlen(ending) + 1;
-    char path[full_length];
-    snprintf(path, full_length, "%s%s.%d.%d%s", start, name, current_pid,
-             current_tid, ending);
-
-    // Create a file at path (O_CREAT), make sure it did not exist before
-    // (O_EXCL), and allow reading and writing it (O_RDWR).
-    int fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0);
-    if (fd < 0) {
-        __mi_printf("[File creation] Failed to open \"%s\": %s\n", path,
-                    strerror(errno));
-        __mi_fail();
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t total_size;
+    if (__builtin_mul_overflow(nmemb, size, &total_size)) {
+        STAT_INC(NumOverflowingReallocArrays);
+        errno = ENOMEM;
+        return NULL;
     }
-    if (unlink(path) < 0) {
-        __mi_printf("[File creation] Failed to unlink \"%s\": %s\n", path,
-                    strerror(errno));
-        __mi_fail();
+    return realloc(ptr, total_size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
     }
-    // Acquire the (write) file lease
-    if (fcntl(fd, F_SETLEASE, F_WRLCK) < 0) {
-        __mi_printf("[File creation] Failed to lease \"%s\": %s\n", path,
-                    strerror(errno));
-        __mi_fail();
+    // The last byte of every low-fat allocation is padding, such that a pointer
+    // right after the usable bytes still belongs to the allocation
+    if (__is_lowfat(ptr)) {
+        return __lowfat_ptr_size(__lowfat_ptr_index(ptr)) - 1;
     }
-    // Use the given size as for the file
-    if (ftruncate(fd, size) < 0) {
-        __mi_printf("[File creation] Failed to truncate \"%s\": %s\n", path,
-                    strerror(errno));
-        __mi_fail();
+    return malloc_usable_size_found(ptr);
+}
+
+// The sizes passed to the sized frees are not needed to find the region of a
+// low-fat allocation, they are only checked against its allocation size. Only
+// allocations that are not low-fat go to the fall-back allocator, no matter
+// which size they are freed with.
+static void sized_free(void *p, size_t size) {
+    if (!__is_lowfat(p)) {
+        if (free_sized_found) {
+            free_sized_found(p, size);
+        } else {
+            free_found(p);
+        }
+        return;
+    }
+    // The last byte of every low-fat allocation is padding
+    size_t allocation_size = __lowfat_ptr_size(__lowfat_ptr_index(p));
+    if (size >= allocation_size) {
+        __mi_debug_printf("Freed %p with size %lu, allocation size %lu\n", p,
+                          size, allocation_size);
+        __mi_fail_with_msg("Sized free with a size that does not match the "
+                           "allocation!\n");
+    }
+    internal_free(p);
+}
+
+void free_sized(void *p, size_t size) {
+    STAT_INC(NumFrees);
+    STAT_INC(NumSizedFrees);
+    if (!hooks_active) {
+        free_found(p);
+        return;
+    }
+
+    hooks_active = 0;
+
+    if (p != NULL) {
+        sized_free(p, size);
+    }
+
+    hooks_active = 1;
+}
+
+void free_aligned_sized(void *p, size_t alignment, size_t size) {
+    STAT_INC(NumFrees);
+    STAT_INC(NumSizedFrees);
+    if (!hooks_active) {
+        free_found(p);
+        return;
+    }
+
+    hooks_active = 0;
+
+    if (p != NULL) {
+        if (!__is_lowfat(p) && free_aligned_sized_found) {
+            free_aligned_sized_found(p, alignment, size);
+        } else {
+            sized_free(p, size);
+        }
+    }
+
+    hooks_active = 1;
+}
+
+size_t __lowfat_malloc_batch(size_t size, size_t n, void **out) {
+    STAT_INC(NumBatchAllocs);
+    if (!hooks_active) {
+        STAT_INC(NumHookDisabled);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = malloc_found(size);
+            if (out[i] == NULL) {
+                return i;
+            }
+        }
+        return n;
+    }
+
+    hooks_active = 0;
+
+    size_t count = 0;
+    unsigned zero_based_index;
+    if (heap_class_for_size(size, &zero_based_index)) {
+        // Like lowfat_aligned_alloc, continue in the overflow banks once the
+        // region of the size is full
+        for (unsigned bank = 0; bank <= HEAP_OVERFLOW_BANKS && count < n;
+             bank++) {
+            size_t bank_count = region_alloc_batch(
+                zero_based_index + bank * NUM_HEAP_CLASSES, size, out + count,
+                n - count, bank == HEAP_OVERFLOW_BANKS);
+            for (size_t i = 0; i < bank_count; i++) {
+                STAT_INC(NumAllocs);
+                STAT_INC(NumLowFatAllocs);
+                if (bank > 0) {
+                    STAT_INC(NumOverflowBankAllocs);
+                }
+            }
+            count += bank_count;
+        }
+        if (count < n) {
+            STAT_INC(NumFullRegionNonFatAllocs);
+        }
+    }
+
+    for (; count < n; count++) {
+        STAT_INC(NumAllocs);
+        out[count] = malloc_found(size);
+        if (out[count] == NULL) {
+            break;
+        }
     }
-    return fd;
+
+    hooks_active = 1;
+    return count;
+}
+
+void __lowfat_free_batch(void *const *ptrs, size_t n) {
+    STAT_INC(NumBatchFrees);
+    if (!hooks_active) {
+        for (size_t i = 0; i < n; i++) {
+            free_found(ptrs[i]);
+        }
+        return;
+    }
+
+    hooks_active = 0;
+
+    size_t i = 0;
+    while (i < n) {
+        void *p = ptrs[i++];
+        if (p == NULL) {
+            continue;
+        }
+        STAT_INC(NumFrees);
+        if (!__is_lowfat(p)) {
+            free_found(p);
+            continue;
+        }
+
+        // Keep the lock of the region as long as the following pointers
+        // belong to it, e.g., for the nodes of a data structure freed in the
+        // order they were allocated in
+        unsigned zero_based_index =
+            __lowfat_get_zero_based_index(__lowfat_ptr_index(p));
+        pthread_mutex_lock(&region_locks[zero_based_index]);
+        while (1) {
+            STAT_INC(NumLowFatFrees);
+            LF_PROFILE(__lowfat_profile_free(zero_based_index));
+            __lowfat_free_list_push(zero_based_index, p);
+            if (i == n || ptrs[i] == NULL || !__is_lowfat(ptrs[i]) ||
+                __lowfat_get_zero_based_index(__lowfat_ptr_index(ptrs[i])) !=
+                    zero_based_index) {
+                break;
+            }
+            p = ptrs[i++];
+            STAT_INC(NumFrees);
+        }
+        pthread_mutex_unlock(&region_locks[zero_based_index]);
+    }
+
+    hooks_active = 1;
+}
+
+#if __GLIBC_PREREQ(2, 33)
+
+struct mallinfo2 mallinfo2(void) {
+    struct mallinfo2 info;
+    if (mallinfo2_found) {
+        info = mallinfo2_found();
+    } else {
+        memset(&info, 0, sizeof(info));
+    }
+
+    // Account the heap regions like the main arena of glibc: the space handed
+    // out from fresh space, split into allocated and freed slots.
+    for (unsigned i = 0; i < NUM_HEAP_REGIONS; i++) {
+        pthread_mutex_lock(&region_locks[i]);
+        size_t allocation_size = __lowfat_size_for_zero_based_index(i);
+        size_t used = (uintptr_t)regions[i] - __lowfat_heap_region_base(i);
+        size_t freed = __lowfat_free_list_length(i) * allocation_size;
+        pthread_mutex_unlock(&region_locks[i]);
+
+        info.arena += used;
+        info.uordblks += used - freed;
+        info.fordblks += freed;
+    }
+    return info;
+}
+
+#endif
+
+// POSIX offers no query whether a stack was set. An unset stack is reported
+// either as an error, as NULL, or, as glibc and musl store the top of the
+// stack, as an address that ends at zero.
+static int has_caller_stack(const pthread_attr_t *attr) {
+    void *stack;
+    size_t stack_size;
+    if (pthread_attr_getstack(attr, &stack, &stack_size) != 0) {
+        return 0;
+    }
+    return stack != NULL && (uintptr_t)stack + stack_size != 0;
+}
+
+// Copy the attributes of attr other than its stack into the fresh attributes
+// copy, only using their public accessors
+static void copy_thread_attributes(pthread_attr_t *copy,
+                                   const pthread_attr_t *attr) {
+    int value;
+    if (pthread_attr_getdetachstate(attr, &value) == 0) {
+        pthread_attr_setdetachstate(copy, value);
+    }
+    if (pthread_attr_getinheritsched(attr, &value) == 0) {
+        pthread_attr_setinheritsched(copy, value);
+    }
+    if (pthread_attr_getschedpolicy(attr, &value) == 0) {
+        pthread_attr_setschedpolicy(copy, value);
+    }
+    struct sched_param param;
+    if (pthread_attr_getschedparam(attr, &param) == 0) {
+        pthread_attr_setschedparam(copy, &param);
+    }
+    if (pthread_attr_getscope(attr, &value) == 0) {
+        pthread_attr_setscope(copy, value);
+    }
+    size_t guard_size;
+    if (pthread_attr_getguardsize(attr, &guard_size) == 0) {
+        pthread_attr_setguardsize(copy, guard_size);
+    }
+    size_t stack_size;
+    if (pthread_attr_getstacksize(attr, &stack_size) == 0) {
+        pthread_attr_setstacksize(copy, stack_size);
+    }
+    // Attributes without an affinity report all CPUs, which must not replace
+    // the affinity that the thread would inherit otherwise
+    cpu_set_t cpus;
+    if (pthread_attr_getaffinity_np(attr, sizeof(cpus), &cpus) == 0 &&
+        CPU_COUNT(&cpus) < CPU_SETSIZE) {
+        pthread_attr_setaffinity_np(copy, sizeof(cpus), &cpus);
+    }
+}
+
+/**
+ * Start threads on low-fat stacks, such that their stack allocations can be
+ * mirrored into the low-fat regions like the ones of the main thread.
+ *
+ * Threads which bring their own stack, are created detached, or request a
+ * larger stack than MIRT_LF_THREAD_STACK_SIZE use a regular stack.
+ */
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg) {
+    if (!pthread_create_found) {
+        initThreadFunctions();
+    }
+
+    if (attr) {
+        // Detached threads end unnoticed, their stacks could not be reused
+        int detach_state;
+        if (pthread_attr_getdetachstate(attr, &detach_state) != 0 ||
+            detach_state == PTHREAD_CREATE_DETACHED ||
+            has_caller_stack(attr)) {
+            STAT_INC(NumNonFatThreadStacks);
+            return pthread_create_found(thread, attr, start_routine, arg);
+        }
+    }
+
+    // The attributes of the caller are opaque and may own memory, so their
+    // settings are copied into attributes of our own instead
+    pthread_attr_t stack_attr;
+    pthread_attr_init(&stack_attr);
+    if (attr) {
+        copy_thread_attributes(&stack_attr, attr);
+    }
+
+    size_t requested_size;
+    pthread_attr_getstacksize(&stack_attr, &requested_size);
+    void *stack;
+    size_t stack_size;
+    int slot =
+        __lowfat_thread_stack_acquire(requested_size, &stack, &stack_size);
+    int res;
+    if (slot < 0) {
+        STAT_INC(NumNonFatThreadStacks);
+        res = pthread_create_found(thread, attr, start_routine, arg);
+    } else {
+        pthread_attr_setstack(&stack_attr, stack, stack_size);
+        res = pthread_create_found(thread, &stack_attr, start_routine, arg);
+        if (res == 0) {
+            __lowfat_thread_stack_set_owner(slot, *thread);
+            STAT_INC(NumLowFatThreadStacks);
+        } else {
+            __lowfat_thread_stack_release(slot);
+        }
+    }
+
+    pthread_attr_destroy(&stack_attr);
+    return res;
+}
+
+// The thread has terminated, so no one uses its stack anymore
+static void release_joined_stack(pthread_t thread) {
+    int slot = __lowfat_thread_stack_find(thread);
+    if (slot >= 0) {
+        __lowfat_thread_stack_release(slot);
+    }
+}
+
+int pthread_join(pthread_t thread, void **retval) {
+    if (!pthread_join_found) {
+        initThreadFunctions();
+    }
+
+    int res = pthread_join_found(thread, retval);
+    if (res == 0) {
+        release_joined_stack(thread);
+    }
+    return res;
+}
+
+int pthread_tryjoin_np(pthread_t thread, void **retval) {
+    if (!pthread_tryjoin_np_found) {
+        initThreadFunctions();
+    }
+
+    int res = pthread_tryjoin_np_found(thread, retval);
+    if (res == 0) {
+        release_joined_stack(thread);
+    }
+    return res;
+}
+
+int pthread_timedjoin_np(pthread_t thread, void **retval,
+                         const struct timespec *abstime) {
+    if (!pthread_timedjoin_np_found) {
+        initThreadFunctions();
+    }
+
+    int res = pthread_timedjoin_np_found(thread, retval, abstime);
+    if (res == 0) {
+        release_joined_stack(thread);
+    }
+    return res;
+}
+
+int pthread_detach(pthread_t thread) {
+    if (!pthread_detach_found) {
+        initThreadFunctions();
+    }
+
+    // The end of a detached thread is not observable, so its stack can never
+    // be reused. Forget the thread before it is gone to not confuse it with a
+    // later thread that gets the same id.
+    int slot = __lowfat_thread_stack_find(thread);
+    int res = pthread_detach_found(thread);
+    if (res == 0 && slot >= 0) {
+        __lowfat_thread_stack_forget(slot);
+    }
+    return res;
 }
 
 #if MIRT_LF_TABLE
 
+// Tables with up to this many pages after their first one are filled instead
+// of aliased
+#define MAX_FILLED_TABLE_PAGES 64
+
+static_assert(OVERFLOW_REGIONS_BASE_NUM + HEAP_OVERFLOW_BANKS * NUM_REGIONS <=
+                  4096 / sizeof(size_t),
+              "All sizes and magics have to be stored in the first page of "
+              "the tables, as the following pages are aliased. Use less "
+              "HEAP_CLASSES_PER_POWER_OF_TWO or HEAP_OVERFLOW_BANKS.");
+
 static_assert(
     NUM_REGIONS - 1 + MIN_ALLOC_SIZE_LOG <
         sizeof(unsigned long long) * CHAR_BIT,
@@ -500,21 +1197,9 @@ static_assert(
     "in the order of EiB), or a very large smallest allocation size. Use a "
     "smaller MIN_ALLOC_SIZE or MAX_(HEAP/STACK/GLOBAL)_ALLOC_SIZE.");
 
-static void __lowfat_create_tables_for_sizes_and_magics() {
-
-    // First, reserve the virtual address space for all possible index values
-    size_t num_pages =
-        (MAXIMAL_ADDRESS / REGION_SIZE) / (__lowfat_page_size / sizeof(size_t));
-    size_t len = num_pages * __lowfat_page_size;
-    void *sizes_mapped =
-        mmap((void *)SIZES_ADDRESS, len, PROT_READ | PROT_WRITE,
-             MAP_NORESERVE | MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (sizes_mapped != (void *)SIZES_ADDRESS) {
-        __mi_printf("[Table creation] Could not mmap space for SIZES: %s\n",
-                    strerror(errno));
-        __mi_fail();
-    }
-
+// Alias all pages of the sizes table after the first one to a single page of a
+// file. Only the first aliased page is writable.
+static void __lowfat_alias_table_pages(size_t len) {
     // Create a file which backs the mapping of the virtual addresses
     int fd = __lowfat_create_file("sizes_and_magics", __lowfat_page_size);
 
@@ -548,6 +1233,32 @@ static void __lowfat_create_tables_for_sizes_and_magics() {
                     strerror(errno));
         __mi_fail();
     }
+}
+
+static void __lowfat_create_tables_for_sizes_and_magics() {
+
+    // First, reserve the virtual address space for all possible index values
+    size_t num_pages =
+        (MAXIMAL_ADDRESS / REGION_SIZE) / (__lowfat_page_size / sizeof(size_t));
+    size_t len = num_pages * __lowfat_page_size;
+    void *sizes_mapped =
+        mmap((void *)SIZES_ADDRESS, len, PROT_READ | PROT_WRITE,
+             MAP_NORESERVE | MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (sizes_mapped != (void *)SIZES_ADDRESS) {
+        __mi_printf("[Table creation] Could not mmap space for SIZES: %s\n",
+                    strerror(errno));
+        __mi_fail();
+    }
+
+    // All pages after the first one only hold SIZE_MAX entries. Small tables
+    // (e.g. 16 pages for the default configuration) are simply filled, which
+    // is cheaper than one mmap per page. Larger ones alias a single page of a
+    // file for all of these pages to save memory.
+    size_t num_filled_pages = num_pages;
+    if (num_pages - 1 > MAX_FILLED_TABLE_PAGES) {
+        __lowfat_alias_table_pages(len);
+        num_filled_pages = 2;
+    }
 
     size_t *sizes_base_ptr = (size_t *)SIZES_ADDRESS;
     // Initialize the sizes
@@ -564,15 +1275,27 @@ static void __lowfat_create_tables_for_sizes_and_magics() {
         index++;
     }
     // Fill the rest of the sizes table with SIZE_MAX values for non-lowfat
-    // allocations
-    while (((uintptr_t)(sizes_base_ptr + index) % __lowfat_page_size) > 0) {
+    // allocations (the aliased pages are only written once)
+    size_t num_entries = num_filled_pages * __lowfat_page_size / sizeof(size_t);
+    while (index < num_entries) {
         sizes_base_ptr[index] = SIZE_MAX;
         index++;
     }
-    for (size_t j = 0; j < __lowfat_page_size / sizeof(size_t); j++) {
-        sizes_base_ptr[index] = SIZE_MAX;
-        index++;
+#if NUM_SUB_REGIONS > 0
+    // Store the sizes of the classes in between two powers of two, for the
+    // primary regions and the overflow banks
+    for (size_t j = 0; j < NUM_SUB_REGIONS * (HEAP_OVERFLOW_BANKS + 1); j++) {
+        sizes_base_ptr[SUB_REGIONS_BASE_NUM + j] =
+            SUB_REGION_SIZES[j % NUM_SUB_REGIONS];
+    }
+#endif
+#if HEAP_OVERFLOW_BANKS > 0
+    // The overflow banks repeat the power of two sizes
+    for (size_t j = 0; j < NUM_REGIONS * HEAP_OVERFLOW_BANKS; j++) {
+        sizes_base_ptr[OVERFLOW_REGIONS_BASE_NUM + j] =
+            1ULL << (MIN_ALLOC_SIZE_LOG + j % NUM_REGIONS);
     }
+#endif
 
     // Protect the sizes from modifications
     if (mprotect((void *)sizes_base_ptr, len, PROT_READ)) {
@@ -610,6 +1333,21 @@ static void __lowfat_create_tables_for_sizes_and_magics() {
     }
     // As the mapped memory is MAP_ANONYMOUS, its default value is zero and we
     // do not initialize the rest here.
+#if NUM_SUB_REGIONS > 0
+    // The classes in between two powers of two store ceil(2^64 / size) to
+    // compute the base with a multiplication (see table_sizes.c)
+    for (size_t j = 0; j < NUM_SUB_REGIONS * (HEAP_OVERFLOW_BANKS + 1); j++) {
+        magics_base_ptr[SUB_REGIONS_BASE_NUM + j] =
+            UINT64_MAX / SUB_REGION_SIZES[j % NUM_SUB_REGIONS] + 1;
+    }
+#endif
+#if HEAP_OVERFLOW_BANKS > 0
+    // The power of two classes in the overflow banks use masks as well
+    for (size_t j = 0; j < NUM_REGIONS * HEAP_OVERFLOW_BANKS; j++) {
+        magics_base_ptr[OVERFLOW_REGIONS_BASE_NUM + j] =
+            UINT64_MAX << (MIN_ALLOC_SIZE_LOG + j % NUM_REGIONS);
+    }
+#endif
 
     // Protect the magics from modifications
     if (mprotect((void *)magics_base_ptr, len, PROT_READ)) {
@@ -666,7 +1404,7 @@ void *__lowfat_move_stack(void *stack_current) {
     // Allocate the new stack
     void *allocated_new_stack =
         mmap((void *)new_stack_base, STACK_SIZE, PROT_READ | PROT_WRITE,
-             MAP_ANONYMOUS | MAP_SHARED | MAP_NORESERVE, -1, 0);
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
     if ((uintptr_t)allocated_new_stack != new_stack_base) {
         printf("LF: Failed to allocate the new stack\n Tried %p (got %p)",
@@ -738,54 +1476,37 @@ int __libc_start_main(int *(main)(int, char **, char **), int argc,
     // set up statistics counters etc.
     __setup_statistics(ubp_av[0]);
 
+    // set up the allocation profile and per-region statistics, if requested
+    LF_PROFILE(__lowfat_profile_setup(regions));
+
 #if MIRT_LF_TABLE
     __lowfat_create_tables_for_sizes_and_magics();
 #endif
 
-    // Create heap regions for each size
-    for (unsigned i = 0; i < NUM_REGIONS; i++) {
-        uintptr_t region_address = (i + 1) * REGION_SIZE + HEAP_REGION_OFFSET;
-        regions[i] = mmap((void *)region_address, HEAP_REGION_SIZE,
-                          PROT_READ | PROT_WRITE,
-                          MAP_ANONYMOUS | MAP_SHARED | MAP_NORESERVE, -1, 0);
-
-        // Check that mmap mapped the desired addresses (otherwise we might get
-        // false positive later for the safety checks)
-        if ((uintptr_t)regions[i] != region_address) {
-            __mi_printf("LF: Failed to mmap the required memory location "
-                        "(heap)!\n\tWanted: %p\n\tGot: %p\n",
-                        (void *)region_address, regions[i]);
-            exit(99);
-        }
-        __mi_debug_printf("Allocated heap region %p (num %d size %llu)\n",
-                          (void *)region_address, i, HEAP_REGION_SIZE);
-    }
-
-    // Create stack regions for each size
-    int fd = __lowfat_create_file("stack", STACK_REGION_SIZE);
-    for (unsigned i = 0; i < NUM_REGIONS; i++) {
-        uintptr_t region_address = (i + 1) * REGION_SIZE + STACK_REGION_OFFSET;
-        stack_regions[i] = mmap(
-            (void *)region_address, STACK_REGION_SIZE, PROT_READ | PROT_WRITE,
-            MAP_ANONYMOUS | MAP_SHARED | MAP_NORESERVE, fd, 0);
-
-        // Make sure we mmaped the requested region
-        if ((uintptr_t)stack_regions[i] != region_address) {
-            __mi_printf("LF: Failed to mmap the required memory location "
-                        "(stack)!\n\tWanted: %p\n\tGot: %p\n",
-                        (void *)region_address, stack_regions[i]);
+    // The heap regions are mapped on their first allocation, so their fresh
+    // space starts at their (not yet mapped) base. Their addresses are reserved
+    // now, such that no other mapping can take their place in the meantime.
+    for (unsigned i = 0; i < NUM_HEAP_REGIONS; i++) {
+        uintptr_t region_base = __lowfat_heap_region_base(i);
+        regions[i] = (void *)region_base;
+        if (!__lowfat_reserve_region(region_base, HEAP_REGION_SIZES[i])) {
+            __mi_printf("LF: Failed to reserve the required memory location "
+                        "(heap)!\n\tWanted: %p\n",
+                        (void *)region_base);
             exit(99);
         }
-        __mi_debug_printf("Allocated stack region %p (num %d size %llu)\n",
-                          (void *)region_address, i, STACK_REGION_SIZE);
     }
 
-    if (close(fd) < 0) {
-        __mi_printf("[Stack aliasing] Closing failed");
-        __mi_fail();
-    }
+    // Create stack regions for each size. All of them map the same file, such
+    // that the mirrors of a stack location in the different regions share
+    // their memory.
+    __lowfat_setup_stack_regions(
+        __lowfat_create_file("stack", STACK_REGION_SIZE));
     __mi_debug_printf("Allocated the stack\n");
 
+    // Reserve the stacks for threads next to the one of the main thread
+    __lowfat_thread_stacks_setup();
+
     // Move the stack
     __lowfat_move_stack_trampoline();
 
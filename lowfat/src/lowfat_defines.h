@@ -28,6 +28,39 @@ static_assert(!(MIRT_LF_TABLE && MIRT_LF_COMPUTED_SIZE),
               "Invalid configuration, either lookup tables or computations can "
               "be used to determine base/size.");
 
+// Freed slots of page-multiple size classes stay committed until the free list
+// of their class holds more than this amount of bytes in such slots. They are
+// then returned to the OS in one batch.
+#ifndef MIRT_LF_DECOMMIT_THRESHOLD
+#define MIRT_LF_DECOMMIT_THRESHOLD (64ULL << 20)
+#endif
+
+// Reallocations that move at least this amount of bytes from one low-fat
+// allocation to another remap the pages instead of copying them.
+#ifndef MIRT_LF_MREMAP_THRESHOLD
+#define MIRT_LF_MREMAP_THRESHOLD (1ULL << 20)
+#endif
+
+// File to which the allocation profile of the heap regions is written if
+// MIRT_LF_PROFILE is defined.
+#ifndef MIRT_LF_PROFILE_FILE
+#define MIRT_LF_PROFILE_FILE "lf_profile.json"
+#endif
+
+// Size of the low-fat stacks of threads created with pthread_create, including
+// a guard page. Threads that request a larger stack use a regular one.
+#ifndef MIRT_LF_THREAD_STACK_SIZE
+#define MIRT_LF_THREAD_STACK_SIZE (8ULL << 20)
+#endif
+
+// Map the stack parts of the low-fat regions on their first access (detected
+// by a SIGSEGV handler) instead of at startup. Opt-in, as system calls that
+// access an unmapped stack region fail with EFAULT instead of faulting, and as
+// the handler replaces the one of the program for SIGSEGV.
+#ifndef MIRT_LF_LAZY_STACK_REGIONS
+#define MIRT_LF_LAZY_STACK_REGIONS 0
+#endif
+
 //===----------------------------------------------------------------------===//
 //                              Shorthands
 //===----------------------------------------------------------------------===//
@@ -0,0 +1,122 @@
+#include "profile.h"
+
+#include "LFSizes.h"
+#include "core.h"
+#include "fail_function.h"
+#include "freelist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(MIRT_LF_PROFILE) || defined(MIRT_STATISTICS)
+
+typedef struct RegionProfile {
+    size_t allocations;
+    size_t live;
+    size_t peak_live;
+    size_t fallbacks;
+    // Sum of the sizes requested by all allocations in the region, compared to
+    // allocations times the allocation size this yields the rounding waste
+    size_t requested_bytes;
+} RegionProfile;
+
+static RegionProfile profiles[NUM_HEAP_REGIONS];
+
+static void *const *fresh_space = NULL;
+
+// Number of bytes of the region that were handed out from fresh space. As
+// fresh space is never given back, this is also the peak.
+static size_t used_bytes(unsigned index) {
+    return (uintptr_t)fresh_space[index] - __lowfat_heap_region_base(index);
+}
+
+#ifdef MIRT_LF_PROFILE
+
+static void __lowfat_print_profile(void) {
+    FILE *dest = fopen(MIRT_LF_PROFILE_FILE, "w");
+    if (!dest) {
+        __mi_printf("LF: Failed to open the profile file '%s'\n",
+                    MIRT_LF_PROFILE_FILE);
+        return;
+    }
+
+    fprintf(dest, "{\n    \"regions\" : [\n");
+    for (unsigned i = 0; i < NUM_HEAP_REGIONS; i++) {
+        RegionProfile *profile = &profiles[i];
+        fprintf(dest,
+                "        {\"size\" : %lu, \"bank\" : %u, "
+                "\"region_size\" : %llu, \"used_bytes\" : %lu, "
+                "\"allocations\" : %lu, \"peak_live\" : %lu, "
+                "\"fallbacks\" : %lu}%s\n",
+                __lowfat_size_for_zero_based_index(i),
+                (unsigned)(i / NUM_HEAP_CLASSES),
+                (unsigned long long)HEAP_REGION_SIZES[i], used_bytes(i),
+                profile->allocations, profile->peak_live, profile->fallbacks,
+                i + 1 < NUM_HEAP_REGIONS ? "," : "");
+    }
+    fprintf(dest, "    ]\n}\n");
+    fclose(dest);
+}
+
+#endif
+
+void __lowfat_profile_setup(void *const *regions) {
+    fresh_space = regions;
+#ifdef MIRT_LF_PROFILE
+    if (atexit(__lowfat_print_profile) != 0) {
+        __mi_printf("LF: Failed to register the profile printer!\n");
+    }
+#endif
+}
+
+void __lowfat_profile_alloc(unsigned index, size_t size) {
+    RegionProfile *profile = &profiles[index];
+    profile->allocations++;
+    profile->requested_bytes += size;
+    profile->live++;
+    if (profile->live > profile->peak_live) {
+        profile->peak_live = profile->live;
+    }
+}
+
+void __lowfat_profile_free(unsigned index) { profiles[index].live--; }
+
+void __lowfat_profile_fallback(unsigned index) { profiles[index].fallbacks++; }
+
+#endif
+
+#ifdef MIRT_STATISTICS
+
+void __lowfat_print_region_stats(FILE *dest) {
+    if (!fresh_space) {
+        return;
+    }
+
+    fprintf(dest, "Low-fat heap regions (only regions in use):\n");
+    fprintf(dest, "%12s %4s %10s %10s %8s %10s %14s %14s %7s %10s\n",
+            "size", "bank", "live", "peak live", "used %", "free list",
+            "requested B", "allocated B", "waste %", "fallbacks");
+    for (unsigned i = 0; i < NUM_HEAP_REGIONS; i++) {
+        RegionProfile *profile = &profiles[i];
+        if (profile->allocations == 0 && profile->fallbacks == 0) {
+            continue;
+        }
+
+        size_t allocation_size = __lowfat_size_for_zero_based_index(i);
+        size_t allocated_bytes = profile->allocations * allocation_size;
+        double used = 100.0 * used_bytes(i) / HEAP_REGION_SIZES[i];
+        double waste =
+            allocated_bytes
+                ? 100.0 * (allocated_bytes - profile->requested_bytes) /
+                      allocated_bytes
+                : 0.0;
+        fprintf(dest,
+                "%12lu %4u %10lu %10lu %8.2f %10lu %14lu %14lu %7.2f %10lu\n",
+                allocation_size, (unsigned)(i / NUM_HEAP_CLASSES),
+                profile->live, profile->peak_live, used,
+                __lowfat_free_list_length(i), profile->requested_bytes,
+                allocated_bytes, waste, profile->fallbacks);
+    }
+}
+
+#endif
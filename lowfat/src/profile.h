@@ -0,0 +1,57 @@
+#pragma once
+
+/**
+ * This file contains declarations for profiling the usage of the low-fat heap
+ * regions.
+ *
+ * If MIRT_LF_PROFILE or MIRT_STATISTICS is defined, the run-time counts the
+ * allocations and frees in every heap region.
+ *
+ * With MIRT_LF_PROFILE, the counters are written to MIRT_LF_PROFILE_FILE at
+ * exit. The generator script can use the resulting file (--profile) to size
+ * every heap region according to the profiled workload.
+ *
+ * With MIRT_STATISTICS, the counters are printed as a table along with the
+ * other statistics (see __lowfat_print_region_stats).
+ *
+ * All counters are updated while the lock of the corresponding region is held.
+ */
+
+#include "lowfat_defines.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+#if defined(MIRT_LF_PROFILE) || defined(MIRT_STATISTICS)
+
+// Remember the pointers to the next fresh space of every heap region, and
+// register the profile printer to run at the very end of the program if
+// MIRT_LF_PROFILE is defined.
+void __lowfat_profile_setup(void *const *regions);
+
+// Record an allocation of size bytes in the region with the given zero-based
+// index.
+void __lowfat_profile_alloc(unsigned index, size_t size);
+
+// Record a free in the region with the given zero-based index.
+void __lowfat_profile_free(unsigned index);
+
+// Record a fall-back allocation as the region with the given zero-based index
+// was full. This is the region of the size in the last overflow bank.
+void __lowfat_profile_fallback(unsigned index);
+
+#define LF_PROFILE(call) call
+
+#else
+
+#define LF_PROFILE(call)
+
+#endif
+
+#ifdef MIRT_STATISTICS
+
+// Print a table with the usage of every heap region that was used at all, this
+// is called by the statistics printer (see MIRT_STATS_EXTRA_PRINTER).
+void __lowfat_print_region_stats(FILE *dest);
+
+#endif
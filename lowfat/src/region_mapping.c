@@ -0,0 +1,440 @@
+#include "region_mapping.h"
+
+#include "LFSizes.h"
+#include "fail_function.h"
+#include "lowfat_defines.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Only defined by glibc 2.28 and later, older kernels ignore the flag and treat
+// the address as a hint.
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static int map_region_noreplace(uintptr_t address, size_t len, int prot,
+                                int flags, int fd) {
+    void *mapped =
+        mmap((void *)address, len, prot, flags | MAP_FIXED_NOREPLACE, fd, 0);
+    if (mapped == (void *)address) {
+        return 1;
+    }
+    if (mapped != MAP_FAILED) {
+        munmap(mapped, len);
+    }
+    return 0;
+}
+
+int __lowfat_map_region(uintptr_t address, size_t len, int flags, int fd) {
+    return map_region_noreplace(address, len, PROT_READ | PROT_WRITE, flags,
+                                fd);
+}
+
+int __lowfat_reserve_region(uintptr_t address, size_t len) {
+    // Inaccessible anonymous memory is not accounted for, and never backed
+    return map_region_noreplace(address, len, PROT_NONE,
+                                MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+                                -1);
+}
+
+int __lowfat_commit_region(uintptr_t address, size_t len, int flags, int fd) {
+    // MAP_FIXED atomically replaces the reservation. If the mapping fails
+    // before that (e.g., as the huge page pool is exhausted), the reservation
+    // stays in place.
+    void *mapped = mmap((void *)address, len, PROT_READ | PROT_WRITE,
+                        flags | MAP_FIXED, fd, 0);
+    return mapped == (void *)address;
+}
+
+// Create a file descriptor to a file in /dev/shm with the given name and size.
+// This is only used if memfd_create is not available.
+static int __lowfat_create_shm_file(char *name, size_t size) {
+
+    // Generate a full path containing the given name
+    char *start = "/dev/shm/lf.";
+    // Use the process/thread id to avoid conflicts with other instances running
+    // in parallel.
+    pid_t current_pid = getpid();
+    pid_t current_tid = gettid();
+    // snprintf with NULL+0 determines the length of the string result as if it
+    // would have been printed some output buffer.
+    int pid_length = snprintf(NULL, 0, "%d", current_pid);
+    int tid_length = snprintf(NULL, 0, "%d", current_tid);
+    char *ending = ".tmp";
+    // Create the full path: all parts, plus two dots and the NUL terminator
+    size_t full_length = strlen(start) + strlen(name) + 1 + pid_length + 1 +
+                         tid_length + strlen(ending) + 1;
+    char path[full_length];
+    snprintf(path, full_length, "%s%s.%d.%d%s", start, name, current_pid,
+             current_tid, ending);
+
+    // Create a file at path (O_CREAT), make sure it did not exist before
+    // (O_EXCL), and allow reading and writing it (O_RDWR).
+    int fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0);
+    if (fd < 0) {
+        __mi_printf("[File creation] Failed to open \"%s\": %s\n", path,
+                    strerror(errno));
+        __mi_fail();
+    }
+    if (unlink(path) < 0) {
+        __mi_printf("[File creation] Failed to unlink \"%s\": %s\n", path,
+                    strerror(errno));
+        __mi_fail();
+    }
+    // Acquire the (write) file lease
+    if (fcntl(fd, F_SETLEASE, F_WRLCK) < 0) {
+        __mi_printf("[File creation] Failed to lease \"%s\": %s\n", path,
+                    strerror(errno));
+        __mi_fail();
+    }
+    // Use the given size as for the file
+    if (ftruncate(fd, size) < 0) {
+        __mi_printf("[File creation] Failed to truncate \"%s\": %s\n", path,
+                    strerror(errno));
+        __mi_fail();
+    }
+    return fd;
+}
+
+int __lowfat_create_file(char *name, size_t size) {
+    // A memory file does not depend on a (sufficiently large) /dev/shm, and
+    // as it cannot be opened by other processes, it needs no lease.
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0) {
+        __mi_debug_printf("memfd_create failed (%s), using /dev/shm\n",
+                          strerror(errno));
+        return __lowfat_create_shm_file(name, size);
+    }
+    if (ftruncate(fd, size) < 0) {
+        __mi_printf("[File creation] Failed to truncate memory file \"%s\": "
+                    "%s\n",
+                    name, strerror(errno));
+        __mi_fail();
+    }
+    return fd;
+}
+
+extern uint64_t __lowfat_page_size;
+
+// The file backing all stack regions. It is kept open to map the regions
+// lazily, and to give forked children their own copy.
+static int stack_file = -1;
+
+// The copy of the stack file for the child of a pending fork
+static int forked_stack_file = -1;
+
+#if MIRT_LF_LAZY_STACK_REGIONS
+
+#define STACK_REGION_UNMAPPED 0
+#define STACK_REGION_MAPPED 1
+#define STACK_REGION_FAILED 2
+
+// The state of the stack region with the given zero-based index. Mapping it
+// fails if something else occupies the region.
+static char stack_region_mapped[NUM_REGIONS];
+
+static int stack_region_is_mapped(unsigned index) {
+    return __atomic_load_n(&stack_region_mapped[index], __ATOMIC_ACQUIRE) ==
+           STACK_REGION_MAPPED;
+}
+
+// The SIGSEGV handler of the program, which is called for all faults that are
+// not caused by an unmapped stack region.
+static struct sigaction program_segv_action;
+
+static int segv_handler_installed = 0;
+
+typedef int (*sigaction_type)(int, const struct sigaction *,
+                              struct sigaction *);
+static sigaction_type sigaction_found = NULL;
+
+typedef sighandler_t (*signal_type)(int, sighandler_t);
+static signal_type signal_found = NULL;
+
+static void initSignalFunctions(void) {
+    sigaction_found = (sigaction_type)dlsym(RTLD_NEXT, "sigaction");
+    signal_found = (signal_type)dlsym(RTLD_NEXT, "signal");
+    if (!sigaction_found || !signal_found) {
+        fprintf(stderr, "Meminstrument: Error finding signal symbols:\n%s\n",
+                dlerror());
+        exit(74);
+    }
+}
+
+static void forward_fault(int sig, siginfo_t *info, void *context) {
+    struct sigaction action = program_segv_action;
+    if (action.sa_flags & SA_RESETHAND) {
+        program_segv_action.sa_handler = SIG_DFL;
+        program_segv_action.sa_flags &= ~SA_SIGINFO;
+    }
+
+    if (action.sa_flags & SA_SIGINFO) {
+        action.sa_sigaction(sig, info, context);
+    } else if (action.sa_handler == SIG_DFL || action.sa_handler == SIG_IGN) {
+        // Faults cannot be ignored, so restore the default action. The access
+        // is repeated after returning, and terminates the program.
+        struct sigaction default_action;
+        memset(&default_action, 0, sizeof(default_action));
+        default_action.sa_handler = SIG_DFL;
+        sigaction_found(SIGSEGV, &default_action, NULL);
+    } else {
+        action.sa_handler(sig);
+    }
+}
+
+static void stack_fault_handler(int sig, siginfo_t *info, void *context) {
+    uintptr_t address = (uintptr_t)info->si_addr;
+    uint64_t index = address / REGION_SIZE;
+    uintptr_t offset = address % REGION_SIZE;
+    if (index < 1 || index > NUM_REGIONS || offset < STACK_REGION_OFFSET ||
+        __atomic_load_n(&stack_region_mapped[index - 1], __ATOMIC_ACQUIRE)) {
+        forward_fault(sig, info, context);
+        return;
+    }
+
+    // Threads faulting on the same region at the same time race to map it,
+    // the losers fail as the region is already mapped. All of them repeat the
+    // faulting access after returning. If something else occupies the region,
+    // the repeated access is forwarded to the program's handler.
+    uintptr_t region_address = index * REGION_SIZE + STACK_REGION_OFFSET;
+    if (__lowfat_map_region(region_address, STACK_REGION_SIZE,
+                            MAP_SHARED | MAP_NORESERVE, stack_file)) {
+        __atomic_store_n(&stack_region_mapped[index - 1], STACK_REGION_MAPPED,
+                         __ATOMIC_RELEASE);
+    } else {
+        char unmapped = STACK_REGION_UNMAPPED;
+        __atomic_compare_exchange_n(&stack_region_mapped[index - 1], &unmapped,
+                                    STACK_REGION_FAILED, 0, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED);
+    }
+}
+
+static void map_stack_regions(void) {
+    if (!sigaction_found) {
+        initSignalFunctions();
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = stack_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction_found(SIGSEGV, &action, &program_segv_action) < 0) {
+        __mi_printf("LF: Failed to install the stack fault handler: %s\n",
+                    strerror(errno));
+        __mi_fail();
+    }
+    segv_handler_installed = 1;
+}
+
+// The handler for stack faults has to stay installed, so handlers the program
+// sets for SIGSEGV are only recorded, and called for all other faults.
+
+int sigaction(int signum, const struct sigaction *act,
+              struct sigaction *oldact) {
+    if (!sigaction_found) {
+        initSignalFunctions();
+    }
+    if (signum != SIGSEGV || !segv_handler_installed) {
+        return sigaction_found(signum, act, oldact);
+    }
+
+    if (oldact) {
+        *oldact = program_segv_action;
+    }
+    if (act) {
+        program_segv_action = *act;
+    }
+    return 0;
+}
+
+sighandler_t signal(int signum, sighandler_t handler) {
+    if (!signal_found) {
+        initSignalFunctions();
+    }
+    if (signum != SIGSEGV || !segv_handler_installed) {
+        return signal_found(signum, handler);
+    }
+
+    sighandler_t previous =
+        (program_segv_action.sa_flags & SA_SIGINFO)
+            ? (sighandler_t)(void (*)(void))program_segv_action.sa_sigaction
+            : program_segv_action.sa_handler;
+    // signal has BSD semantics in glibc
+    memset(&program_segv_action, 0, sizeof(program_segv_action));
+    program_segv_action.sa_handler = handler;
+    program_segv_action.sa_flags = SA_RESTART;
+    sigemptyset(&program_segv_action.sa_mask);
+    return previous;
+}
+
+#else
+
+static int stack_region_is_mapped(unsigned index) {
+    (void)index;
+    return 1;
+}
+
+static void map_stack_region(unsigned index) {
+    uintptr_t region_address = (index + 1) * REGION_SIZE + STACK_REGION_OFFSET;
+    if (!__lowfat_map_region(region_address, STACK_REGION_SIZE,
+                             MAP_SHARED | MAP_NORESERVE, stack_file)) {
+        __mi_printf("LF: Failed to mmap the required memory location "
+                    "(stack)!\n\tWanted: %p\n",
+                    (void *)region_address);
+        exit(99);
+    }
+    __mi_debug_printf("Allocated stack region %p (num %d size %llu)\n",
+                      (void *)region_address, index, STACK_REGION_SIZE);
+}
+
+static void map_stack_regions(void) {
+    for (unsigned i = 0; i < NUM_REGIONS; i++) {
+        map_stack_region(i);
+    }
+}
+
+#endif
+
+// All stack regions alias the same shared file, so a forked child would share
+// the objects on its stack with the parent. Before the fork, the contents of
+// the file are copied to a new one, which the child maps over its stack
+// regions. Only the thread calling fork survives in the child, and its stack
+// cannot change until fork returns, so the copy is consistent for the child.
+//
+// Only the part of the file that mirrors the live stack of the calling thread
+// is copied: from its current stack pointer up to the top of the main stack or
+// of its thread stack. The mirrors of other threads' stacks are zero in the
+// child, but these threads do not exist there anyway.
+
+// The offset into the stack file of the top of the stack that contains offset
+static uintptr_t stack_top_offset(uintptr_t offset) {
+    if (offset < STACK_SIZE) {
+        return STACK_SIZE;
+    }
+    uintptr_t slot = (offset - STACK_SIZE) / MIRT_LF_THREAD_STACK_SIZE;
+    uintptr_t top = STACK_SIZE + (slot + 1) * MIRT_LF_THREAD_STACK_SIZE;
+    return top < STACK_REGION_SIZE ? top : STACK_REGION_SIZE;
+}
+
+static void copy_stack_file(int fd) {
+    uintptr_t source = 0;
+    for (unsigned i = 0; i < NUM_REGIONS && !source; i++) {
+        if (stack_region_is_mapped(i)) {
+            source = (i + 1) * REGION_SIZE + STACK_REGION_OFFSET;
+        }
+    }
+    if (!source) {
+        // Without any mapped stack region, the file cannot hold any data
+        return;
+    }
+
+    // Everything below the frame of this function is dead after fork returns
+    uintptr_t stack_base =
+        BASE_STACK_REGION_NUM * REGION_SIZE + STACK_REGION_OFFSET;
+    uintptr_t current = (uintptr_t)__builtin_frame_address(0);
+    if (current < stack_base || current >= stack_base + STACK_REGION_SIZE) {
+        // The calling thread runs on a regular stack, which is not mirrored
+        return;
+    }
+    off_t limit = stack_top_offset(current - stack_base);
+
+    // Only copy the parts of the (sparse) file that hold data
+    off_t end = (current - stack_base) & ~(uintptr_t)(__lowfat_page_size - 1);
+    while (end < limit) {
+        off_t start = lseek(stack_file, end, SEEK_DATA);
+        if (start < 0 && errno == ENXIO) {
+            // No data after end
+            break;
+        }
+        if (start >= 0) {
+            end = lseek(stack_file, start, SEEK_HOLE);
+        }
+        if (start < 0 || end < 0) {
+            __mi_printf("LF: Failed to find the data of the stack regions: "
+                        "%s\n",
+                        strerror(errno));
+            __mi_fail();
+        }
+        if (start >= limit) {
+            break;
+        }
+        if (end > limit) {
+            end = limit;
+        }
+        while (start < end) {
+            ssize_t written = pwrite(fd, (void *)(source + start), end - start,
+                                     start);
+            if (written < 0 && errno != EINTR) {
+                __mi_printf("LF: Failed to copy the stack regions: %s\n",
+                            strerror(errno));
+                __mi_fail();
+            }
+            start += written > 0 ? written : 0;
+        }
+    }
+}
+
+static void stack_regions_prepare_fork(void) {
+    forked_stack_file = __lowfat_create_file("stack", STACK_REGION_SIZE);
+    copy_stack_file(forked_stack_file);
+}
+
+static void stack_regions_fork_parent(void) {
+    close(forked_stack_file);
+    forked_stack_file = -1;
+}
+
+static void stack_regions_fork_child(void) {
+    for (unsigned i = 0; i < NUM_REGIONS; i++) {
+        if (!stack_region_is_mapped(i)) {
+            continue;
+        }
+        uintptr_t region_address = (i + 1) * REGION_SIZE + STACK_REGION_OFFSET;
+        void *mapped = mmap((void *)region_address, STACK_REGION_SIZE,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_NORESERVE | MAP_FIXED,
+                            forked_stack_file, 0);
+        if (mapped != (void *)region_address) {
+            __mi_printf("LF: Failed to remap the stack region %p after fork: "
+                        "%s\n",
+                        (void *)region_address, strerror(errno));
+            exit(99);
+        }
+    }
+    close(stack_file);
+    stack_file = forked_stack_file;
+    forked_stack_file = -1;
+}
+
+void __lowfat_discard_stack_file(size_t offset, size_t len) {
+    if (fallocate(stack_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, len) < 0) {
+        __mi_debug_printf("Failed to discard %lu bytes of the stack file at "
+                          "%lu: %s\n",
+                          len, offset, strerror(errno));
+    }
+}
+
+void __lowfat_setup_stack_regions(int fd) {
+    stack_file = fd;
+    map_stack_regions();
+
+    int res = pthread_atfork(stack_regions_prepare_fork,
+                             stack_regions_fork_parent,
+                             stack_regions_fork_child);
+    if (res != 0) {
+        __mi_printf("LF: Failed to register the fork handlers: %s\n",
+                    strerror(res));
+        __mi_fail();
+    }
+}
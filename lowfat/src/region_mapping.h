@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The low-fat regions are mapped lazily to keep the startup cheap for programs
+// that only use a few size classes: heap regions on the first allocation from
+// their fresh space, and, if MIRT_LF_LAZY_STACK_REGIONS is set, stack regions
+// on the first access to them. The address ranges of the heap regions are
+// reserved at startup, such that no other mapping can be placed there.
+
+// Map len bytes readable and writable at exactly the given address, without
+// replacing anything that is already mapped there. flags and fd are passed to
+// mmap. Returns 1 on success, and 0 otherwise.
+int __lowfat_map_region(uintptr_t address, size_t len, int flags, int fd);
+
+// Reserve len bytes at exactly the given address without making them
+// accessible, and without replacing anything that is already mapped there.
+// Returns 1 on success, and 0 otherwise.
+int __lowfat_reserve_region(uintptr_t address, size_t len);
+
+// Map len bytes readable and writable over a range reserved with
+// __lowfat_reserve_region. flags and fd are passed to mmap. Returns 1 on
+// success, and 0 otherwise (the range stays reserved then).
+int __lowfat_commit_region(uintptr_t address, size_t len, int flags, int fd);
+
+// Create a file descriptor to an anonymous file with the given name and size.
+int __lowfat_create_file(char *name, size_t size);
+
+// Set up the stack parts of the low-fat regions, which are all backed by the
+// file fd. With MIRT_LF_LAZY_STACK_REGIONS, a SIGSEGV handler maps each stack
+// region on the first access to it. Otherwise, all stack regions are mapped
+// immediately. Forked children get a private copy of the file.
+void __lowfat_setup_stack_regions(int fd);
+
+// Return the memory of len bytes of the stack file at offset to the OS, the
+// stack regions read zeros there afterwards.
+void __lowfat_discard_stack_file(size_t offset, size_t len);
@@ -9,6 +9,37 @@
 
 #if MIRT_LF_TABLE
 
+#if NUM_SUB_REGIONS > 0
+
+static_assert(HEAP_REGION_OFFSET == 0,
+              "The base computation for the size classes in between two powers "
+              "of two requires the heap to start at the beginning of a "
+              "region.");
+
+// Size classes in between two powers of two are placed in their own regions,
+// starting at region SUB_REGIONS_BASE_NUM, followed by their regions in the
+// overflow banks. Their bases cannot be determined with a mask. Instead, the
+// MAGICS table holds ceil(2^64 / size) for them, which turns the division of
+// the offset in the region by the size into a multiplication. This is exact as
+// long as the offset times the size fits into 64 bit, which the generator
+// script ensures.
+static __attribute__((__always_inline__)) int
+is_sub_region_index(uint64_t index) {
+    return index - SUB_REGIONS_BASE_NUM <
+           NUM_SUB_REGIONS * (HEAP_OVERFLOW_BANKS + 1);
+}
+
+static __attribute__((__always_inline__)) uintptr_t
+sub_region_base(uintptr_t ptr, uint64_t index) {
+    uintptr_t offset = ptr & (REGION_SIZE - 1);
+    uint64_t slot = ((unsigned __int128)offset *
+                     ((uint64_t *)MAGICS_ADDRESS)[index]) >>
+                    64;
+    return ptr - offset + slot * ((uint64_t *)SIZES_ADDRESS)[index];
+}
+
+#endif
+
 //===------------------- Determine Base/Index/Size ------------------------===//
 
 uint64_t __lowfat_ptr_index(void *ptr) {
@@ -16,11 +47,21 @@ uint64_t __lowfat_ptr_index(void *ptr) {
 }
 
 uintptr_t __lowfat_ptr_base(void *ptr, uint64_t index) {
+#if NUM_SUB_REGIONS > 0
+    if (is_sub_region_index(index)) {
+        return sub_region_base((uintptr_t)ptr, index);
+    }
+#endif
     return (uintptr_t)ptr & ((uint64_t *)MAGICS_ADDRESS)[index];
 }
 
 uintptr_t __lowfat_ptr_base_without_index(void *ptr) {
     uint64_t index = __lowfat_ptr_index(ptr);
+#if NUM_SUB_REGIONS > 0
+    if (is_sub_region_index(index)) {
+        return sub_region_base((uintptr_t)ptr, index);
+    }
+#endif
     return (uintptr_t)ptr & ((uint64_t *)MAGICS_ADDRESS)[index];
 }
 
@@ -29,6 +70,24 @@ uint64_t __lowfat_ptr_size(uint64_t index) {
 }
 
 uint64_t __lowfat_index_for_size(size_t size) {
+#if NUM_SUB_REGIONS > 0
+    // Check if the size fits into one of the classes in between the powers of
+    // two. The interval (2^(log-1), 2^log] is split into equally sized steps,
+    // the last of which is the power of two class itself.
+    if (size > (1ULL << (SUB_REGION_MIN_LOG - 1))) {
+        unsigned log = 64 - __builtin_clzll(size - 1);
+        if (log <= SUB_REGION_MAX_LOG) {
+            unsigned step_log = log - 1 - SUB_REGION_CLASSES_LOG;
+            uint64_t step = (size - 1 - (1ULL << (log - 1))) >> step_log;
+            uint64_t sub_classes = (1ULL << SUB_REGION_CLASSES_LOG) - 1;
+            if (step < sub_classes) {
+                return SUB_REGIONS_BASE_NUM +
+                       (log - SUB_REGION_MIN_LOG) * sub_classes + step;
+            }
+        }
+    }
+#endif
+
     // We determine the index by counting leading zeros. A small size has many
     // leading zeros, and hence a large clz value. We subtract this from 64 to
     // get a small index for a large clz value. Additionally, we have to
@@ -57,7 +116,57 @@ int __is_lowfat(void *ptr) {
     return 0;
 }
 
-uint64_t __lowfat_get_zero_based_index(uint64_t index) { return index - 1; }
+// The zero-based indices of the classes in between two powers of two follow
+// the ones of the power of two classes. Every overflow bank repeats this
+// layout, i.e. the zero-based index of a region is its bank times
+// NUM_HEAP_CLASSES plus the index of its class in the primary bank.
+uint64_t __lowfat_get_zero_based_index(uint64_t index) {
+#if NUM_SUB_REGIONS > 0
+    if (is_sub_region_index(index)) {
+        uint64_t sub_index = index - SUB_REGIONS_BASE_NUM;
+        return sub_index / NUM_SUB_REGIONS * NUM_HEAP_CLASSES + NUM_REGIONS +
+               sub_index % NUM_SUB_REGIONS;
+    }
+#endif
+#if HEAP_OVERFLOW_BANKS > 0
+    if (index >= OVERFLOW_REGIONS_BASE_NUM) {
+        uint64_t overflow_index = index - OVERFLOW_REGIONS_BASE_NUM;
+        return (overflow_index / NUM_REGIONS + 1) * NUM_HEAP_CLASSES +
+               overflow_index % NUM_REGIONS;
+    }
+#endif
+    return index - 1;
+}
+
+static __attribute__((__always_inline__)) uint64_t
+region_index_for_zero_based_index(uint64_t zero_based_index) {
+    uint64_t bank = zero_based_index / NUM_HEAP_CLASSES;
+    uint64_t class_index = zero_based_index % NUM_HEAP_CLASSES;
+#if NUM_SUB_REGIONS > 0
+    if (class_index >= NUM_REGIONS) {
+        return SUB_REGIONS_BASE_NUM + bank * NUM_SUB_REGIONS + class_index -
+               NUM_REGIONS;
+    }
+#endif
+#if HEAP_OVERFLOW_BANKS > 0
+    if (bank > 0) {
+        return OVERFLOW_REGIONS_BASE_NUM + (bank - 1) * NUM_REGIONS +
+               class_index;
+    }
+#endif
+    (void)bank;
+    return class_index + 1;
+}
+
+uint64_t __lowfat_size_for_zero_based_index(uint64_t zero_based_index) {
+    return __lowfat_ptr_size(
+        region_index_for_zero_based_index(zero_based_index));
+}
+
+uintptr_t __lowfat_heap_region_base(uint64_t zero_based_index) {
+    return region_index_for_zero_based_index(zero_based_index) * REGION_SIZE +
+           HEAP_REGION_OFFSET;
+}
 
 //===----------------------------- Checks ---------------------------------===//
 
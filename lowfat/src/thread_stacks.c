@@ -0,0 +1,170 @@
+#include "thread_stacks.h"
+
+#include "LFSizes.h"
+#include "fail_function.h"
+#include "lowfat_defines.h"
+#include "region_mapping.h"
+#include "statistics.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+extern uint64_t __lowfat_page_size;
+
+// The stack part of the region, the stack file mirrors it at the same offsets
+#define STACK_PART_BASE                                                        \
+    (BASE_STACK_REGION_NUM * REGION_SIZE + STACK_REGION_OFFSET)
+
+#define THREAD_STACKS_BASE (STACK_PART_BASE + STACK_SIZE)
+
+#define NUM_THREAD_STACKS                                                      \
+    ((STACK_REGION_SIZE - STACK_SIZE) / MIRT_LF_THREAD_STACK_SIZE)
+
+#if NUM_THREAD_STACKS > 0
+
+static pthread_mutex_t thread_stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int thread_stacks_ready = 0;
+
+// Slots below this one were handed out at least once, the ones above are still
+// untouched and have no guard page yet
+static unsigned next_fresh_slot = 0;
+
+// Stack of the numbers of released slots
+static unsigned released_slots[NUM_THREAD_STACKS];
+static size_t num_released_slots = 0;
+
+// The thread running on every slot that is in use and not forgotten
+static pthread_t owners[NUM_THREAD_STACKS];
+static char has_owner[NUM_THREAD_STACKS];
+
+static void *slot_address(unsigned slot) {
+    return (void *)(THREAD_STACKS_BASE + slot * MIRT_LF_THREAD_STACK_SIZE);
+}
+
+void __lowfat_thread_stacks_setup(void) {
+    size_t len = NUM_THREAD_STACKS * MIRT_LF_THREAD_STACK_SIZE;
+    void *mapped =
+        mmap((void *)THREAD_STACKS_BASE, len, PROT_READ | PROT_WRITE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if ((uintptr_t)mapped != THREAD_STACKS_BASE) {
+        __mi_printf("LF: Failed to mmap the required memory location "
+                    "(thread stacks)!\n\tWanted: %p\n\tGot: %p\n",
+                    (void *)THREAD_STACKS_BASE, mapped);
+        __mi_fail();
+    }
+
+    pthread_mutex_lock(&thread_stacks_lock);
+    thread_stacks_ready = 1;
+    pthread_mutex_unlock(&thread_stacks_lock);
+}
+
+int __lowfat_thread_stack_acquire(size_t size, void **stack,
+                                  size_t *stack_size) {
+    // Like for the stacks of glibc, the guard page is part of the requested
+    // size
+    if (size > MIRT_LF_THREAD_STACK_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&thread_stacks_lock);
+    int slot = -1;
+    if (!thread_stacks_ready) {
+        // not set up yet, the caller has to use a regular stack
+    } else if (num_released_slots > 0) {
+        slot = released_slots[--num_released_slots];
+    } else if (next_fresh_slot < NUM_THREAD_STACKS) {
+        slot = next_fresh_slot++;
+        // Stacks grow downwards, so protect the lowest page of the slot to
+        // catch overflows into the stack below
+        if (mprotect(slot_address(slot), __lowfat_page_size, PROT_NONE) < 0) {
+            __mi_printf("LF: Failed to protect the guard page of thread stack "
+                        "%d: %s\n",
+                        slot, strerror(errno));
+            __mi_fail();
+        }
+    }
+    pthread_mutex_unlock(&thread_stacks_lock);
+
+    if (slot >= 0) {
+        *stack = slot_address(slot) + __lowfat_page_size;
+        *stack_size = MIRT_LF_THREAD_STACK_SIZE - __lowfat_page_size;
+    }
+    return slot;
+}
+
+void __lowfat_thread_stack_set_owner(int slot, pthread_t thread) {
+    pthread_mutex_lock(&thread_stacks_lock);
+    owners[slot] = thread;
+    has_owner[slot] = 1;
+    pthread_mutex_unlock(&thread_stacks_lock);
+}
+
+void __lowfat_thread_stack_release(int slot) {
+    // Return the physical memory of the stack and of its mirror in the stack
+    // file to the OS, the next thread running on it gets fresh pages
+    void *stack = slot_address(slot) + __lowfat_page_size;
+    size_t len = MIRT_LF_THREAD_STACK_SIZE - __lowfat_page_size;
+    if (madvise(stack, len, MADV_DONTNEED) < 0) {
+        __mi_debug_printf("Failed to decommit thread stack %d: %s\n", slot,
+                          strerror(errno));
+    }
+    __lowfat_discard_stack_file((uintptr_t)stack - STACK_PART_BASE, len);
+
+    pthread_mutex_lock(&thread_stacks_lock);
+    has_owner[slot] = 0;
+    released_slots[num_released_slots++] = slot;
+    pthread_mutex_unlock(&thread_stacks_lock);
+}
+
+int __lowfat_thread_stack_find(pthread_t thread) {
+    int slot = -1;
+    pthread_mutex_lock(&thread_stacks_lock);
+    for (unsigned i = 0; i < next_fresh_slot; i++) {
+        if (has_owner[i] && pthread_equal(owners[i], thread)) {
+            slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread_stacks_lock);
+    return slot;
+}
+
+void __lowfat_thread_stack_forget(int slot) {
+    pthread_mutex_lock(&thread_stacks_lock);
+    has_owner[slot] = 0;
+    pthread_mutex_unlock(&thread_stacks_lock);
+}
+
+#else
+
+// The main thread's stack occupies the whole stack part of its region, so all
+// threads use regular stacks.
+
+void __lowfat_thread_stacks_setup(void) {}
+
+int __lowfat_thread_stack_acquire(size_t size, void **stack,
+                                  size_t *stack_size) {
+    (void)size;
+    (void)stack;
+    (void)stack_size;
+    return -1;
+}
+
+void __lowfat_thread_stack_set_owner(int slot, pthread_t thread) {
+    (void)slot;
+    (void)thread;
+}
+
+void __lowfat_thread_stack_release(int slot) { (void)slot; }
+
+int __lowfat_thread_stack_find(pthread_t thread) {
+    (void)thread;
+    return -1;
+}
+
+void __lowfat_thread_stack_forget(int slot) { (void)slot; }
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Stacks for threads created with pthread_create are carved out of the stack
+// part of the region that also holds the stack of the main thread, above the
+// STACK_SIZE bytes used by it. Like the main stack, their stack allocations
+// can then be mirrored into the stack parts of the low-fat regions.
+//
+// The stack part is split into slots of MIRT_LF_THREAD_STACK_SIZE bytes, the
+// lowest page of every slot is a guard page. A slot is reused once the thread
+// running on it was joined, slots of threads that are detached after their
+// creation are never reused.
+//
+// All functions are thread-safe.
+
+// Reserve the address space for the thread stacks. Until this is called, no
+// thread stacks are handed out.
+void __lowfat_thread_stacks_setup(void);
+
+// Get an unused thread stack for a thread that requested a stack of size bytes
+// (including its guard page). On success, the start and usable size of the
+// stack are stored in stack and stack_size and the slot number of the stack is
+// returned. Returns -1 if there is no thread stack of the requested size
+// available.
+int __lowfat_thread_stack_acquire(size_t size, void **stack,
+                                  size_t *stack_size);
+
+// Associate the stack in the given slot with the thread running on it
+void __lowfat_thread_stack_set_owner(int slot, pthread_t thread);
+
+// Make the stack in the given slot available again, no thread may be running
+// on it anymore
+void __lowfat_thread_stack_release(int slot);
+
+// Return the slot of the stack the given thread runs on, or -1 if it does not
+// run on a low-fat thread stack
+int __lowfat_thread_stack_find(pthread_t thread);
+
+// Forget the owner of the stack in the given slot, such that it is never
+// reused. This is necessary for detached threads, as their end is not
+// observable.
+void __lowfat_thread_stack_forget(int slot);
@@ -0,0 +1,269 @@
+// Compares the batch checks (with the AVX2 gathers if the CPU supports them)
+// to the scalar checks of core.h, built together with the run-time sources
+// once for every way to determine base and size, with and without
+// MIRT_REPORT_PTR_OVERFLOW.
+//
+// Every batch holds in-bounds triples of random low-fat and non-fat witnesses,
+// and one candidate triple close to (or beyond) the bounds of its allocation,
+// at a random position. The scalar check of the candidate decides whether the
+// batch has to fail. Expected failures, and the scalar check of the candidate,
+// run in forked children.
+//
+// With the sub-classes of `make test-config`, the witnesses also come from the
+// regions in between two powers of two, whose lanes are checked again with the
+// scalar checks.
+
+#include "LFSizes.h"
+#include "core.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if MIRT_LF_TABLE
+#define VARIANT "table"
+#else
+#define VARIANT "computed"
+#endif
+
+#ifdef MIRT_REPORT_PTR_OVERFLOW
+#define OVERFLOW_VARIANT ", reporting pointer overflows"
+#else
+#define OVERFLOW_VARIANT ""
+#endif
+
+#define NUM_WITNESSES 256
+#define NUM_BATCHES 400
+// Longer than four groups of four, with a tail of up to three scalar lanes
+#define MAX_BATCH 19
+#define MAX_ACCESS_SIZE 16
+#define NON_FAT_SIZE 4096
+
+enum check_kind { DEREF, DEREF_INNER_WITNESS, OOB };
+
+static const char *const kind_names[] = {"deref", "deref inner witness",
+                                         "oob"};
+
+typedef struct {
+    char *base;
+    size_t size;
+} allocation;
+
+static allocation allocations[NUM_WITNESSES];
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Most witnesses are low-fat allocations of random sizes (covering all classes
+// up to 64 KiB), the others point into memory outside of the low-fat regions
+static void create_allocations(void) {
+    char *non_fat = mmap(NULL, NON_FAT_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    for (unsigned i = 0; i < NUM_WITNESSES; i++) {
+        if (i % 8 == 0) {
+            allocations[i].base = non_fat + next_random() % NON_FAT_SIZE;
+            allocations[i].size = 0;
+            continue;
+        }
+        size_t size = 1 + next_random() % (1 << (4 + next_random() % 13));
+        char *p = malloc(size);
+        allocations[i].base = (char *)__lowfat_ptr_base_without_index(p);
+        allocations[i].size = __lowfat_ptr_size(__lowfat_ptr_index(p));
+    }
+}
+
+typedef struct {
+    void *witnesses[MAX_BATCH];
+    void *ptrs[MAX_BATCH];
+    size_t sizes[MAX_BATCH];
+    size_t n;
+    size_t candidate;
+} batch;
+
+static void set_in_bounds(batch *b, size_t i, enum check_kind kind) {
+    allocation *a = &allocations[next_random() % NUM_WITNESSES];
+    if (a->size == 0) {
+        // The checks skip non-fat witnesses
+        b->witnesses[i] = a->base;
+        b->ptrs[i] = a->base + next_random() % NON_FAT_SIZE;
+        b->sizes[i] = 1 + next_random() % MAX_ACCESS_SIZE;
+        return;
+    }
+    size_t size = kind == OOB ? 1 : 1 + next_random() % MAX_ACCESS_SIZE;
+    if (size > a->size) {
+        size = a->size;
+    }
+    b->ptrs[i] = a->base + next_random() % (a->size - size + 1);
+    b->sizes[i] = size;
+    b->witnesses[i] = kind == DEREF ? a->base
+                                    : a->base + next_random() % a->size;
+}
+
+// A triple at the edges of its allocation, which might be in bounds or not
+static void set_candidate(batch *b, size_t i, enum check_kind kind) {
+    allocation *a = &allocations[next_random() % NUM_WITNESSES];
+    size_t size = kind == OOB ? 1 : 1 + next_random() % MAX_ACCESS_SIZE;
+    ptrdiff_t delta = (ptrdiff_t)(next_random() % 5) - 2;
+    switch (next_random() % 3) {
+    case 0:
+        // Around the end of the allocation
+        b->ptrs[i] = a->base + a->size - size + delta;
+        break;
+    case 1:
+        // Around the base
+        b->ptrs[i] = a->base + delta;
+        break;
+    default:
+        // An access that is larger than the allocation
+        if (kind != OOB) {
+            size = a->size + 1 + next_random() % MAX_ACCESS_SIZE;
+        }
+        b->ptrs[i] = a->base;
+        break;
+    }
+    b->sizes[i] = size;
+    b->witnesses[i] =
+        kind == DEREF || a->size == 0 ? a->base
+                                      : a->base + next_random() % a->size;
+}
+
+static void generate(batch *b, enum check_kind kind) {
+    b->n = 1 + next_random() % MAX_BATCH;
+    b->candidate = next_random() % b->n;
+    for (size_t i = 0; i < b->n; i++) {
+        if (i == b->candidate) {
+            set_candidate(b, i, kind);
+        } else {
+            set_in_bounds(b, i, kind);
+        }
+    }
+}
+
+static void check_scalar(const batch *b, size_t i, enum check_kind kind) {
+    switch (kind) {
+    case DEREF:
+        __lowfat_check_deref(b->witnesses[i], b->ptrs[i], b->sizes[i]);
+        break;
+    case DEREF_INNER_WITNESS:
+        __lowfat_check_deref_inner_witness(b->witnesses[i], b->ptrs[i],
+                                           b->sizes[i]);
+        break;
+    case OOB:
+        __lowfat_check_oob(b->witnesses[i], b->ptrs[i]);
+        break;
+    }
+}
+
+static void check_batch(const batch *b, enum check_kind kind) {
+    switch (kind) {
+    case DEREF:
+        __lowfat_check_deref_batch(b->witnesses, b->ptrs, b->sizes, b->n);
+        break;
+    case DEREF_INNER_WITNESS:
+        __lowfat_check_deref_inner_witness_batch(b->witnesses, b->ptrs,
+                                                 b->sizes, b->n);
+        break;
+    case OOB:
+        __lowfat_check_oob_batch(b->witnesses, b->ptrs, b->n);
+        break;
+    }
+}
+
+// Runs the scalar check of the candidate (or the whole batch) in a child,
+// returns 1 if it failed, and -1 if the child did not finish regularly
+static int fails_in_child(const batch *b, enum check_kind kind, int whole) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Keep the error reports of the expected failures quiet
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (whole) {
+            check_batch(b, kind);
+        } else {
+            check_scalar(b, b->candidate, kind);
+        }
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return -1;
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT) {
+        return 1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void print_batch(const batch *b) {
+    for (size_t i = 0; i < b->n; i++) {
+        printf("  %s%zu: witness %p, ptr %p, size %zu\n",
+               i == b->candidate ? "*" : " ", i, b->witnesses[i], b->ptrs[i],
+               b->sizes[i]);
+    }
+}
+
+static int test_kind(enum check_kind kind) {
+    unsigned failing = 0;
+    for (unsigned run = 0; run < NUM_BATCHES; run++) {
+        batch b;
+        generate(&b, kind);
+        for (size_t i = 0; i < b.n; i++) {
+            if (i != b.candidate) {
+                check_scalar(&b, i, kind);
+            }
+        }
+
+        int expected = fails_in_child(&b, kind, 0);
+        if (expected < 0) {
+            printf("%s: the scalar check did not finish\n", kind_names[kind]);
+            return 1;
+        }
+        if (!expected) {
+            check_batch(&b, kind);
+            continue;
+        }
+        failing++;
+        if (fails_in_child(&b, kind, 1) != 1) {
+            printf("%s: the batch did not fail like the scalar check of "
+                   "triple %zu\n",
+                   kind_names[kind], b.candidate);
+            print_batch(&b);
+            return 1;
+        }
+    }
+    if (failing == 0 || failing == NUM_BATCHES) {
+        printf("%s: %u of %u batches failed, the candidates do not cover both "
+               "outcomes\n",
+               kind_names[kind], failing, NUM_BATCHES);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    __builtin_cpu_init();
+    printf("Batch checks (" VARIANT OVERFLOW_VARIANT "), %s\n",
+           __builtin_cpu_supports("avx2") ? "AVX2" : "scalar fallback");
+
+    create_allocations();
+    if (test_kind(DEREF) || test_kind(DEREF_INNER_WITNESS) ||
+        test_kind(OOB)) {
+        return 1;
+    }
+
+    printf("Batch checks passed\n");
+    return 0;
+}
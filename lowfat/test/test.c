@@ -1,5 +1,17 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "LFSizes.h"
 #include "core.h"
 
 // Test: Access on OOB element
@@ -19,7 +31,695 @@ int test_basic_check(void) {
     return 1;
 }
 
+// Test: Aligned allocations reuse freed slots that are sufficiently aligned
+int test_aligned_reuse(void) {
+    enum { NUM_SLOTS = 64 };
+    void *slots[NUM_SLOTS];
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        slots[i] = malloc(60);
+    }
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        free(slots[i]);
+    }
+
+    void *p;
+    if (posix_memalign(&p, 512, 60) != 0 || (uintptr_t)p % 512 != 0) {
+        printf("Aligned allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        if (slots[i] == p) {
+            free(p);
+            return 0;
+        }
+    }
+    printf("Aligned allocation did not reuse a free slot\n");
+    return 1;
+}
+
+// Test: Alignments larger than REGION_SIZE are not taken from the free list,
+// even though the first slot of a region, which is freed here, is kept in the
+// bucket that stands for them
+int test_large_alignment(void) {
+    free(malloc(1000));
+
+    // The fall-back allocator might not be able to reserve that much
+    void *p;
+    size_t alignment = REGION_SIZE << 2;
+    if (posix_memalign(&p, alignment, 1000) != 0) {
+        return 0;
+    }
+    if ((uintptr_t)p % alignment != 0) {
+        printf("Allocation with a large alignment is not aligned\n");
+        return 1;
+    }
+    free(p);
+    return 0;
+}
+
+// Test: Reallocations to a size of the same class keep the allocation. The
+// sizes share a class also with four classes per power of two.
+int test_realloc_in_place(void) {
+    char *p = malloc(100);
+    memset(p, 'a', 100);
+    if (realloc(p, 105) != p || realloc(p, 97) != p) {
+        printf("Reallocation within the size class moved the allocation\n");
+        return 1;
+    }
+    for (int i = 0; i < 97; i++) {
+        if (p[i] != 'a') {
+            printf("Reallocation within the size class lost its contents\n");
+            return 1;
+        }
+    }
+    free(p);
+    return 0;
+}
+
+// Counts the calls to mremap, and lets them fail like on kernels without
+// MREMAP_DONTUNMAP if mremap_unsupported is set
+static int mremap_calls, mremap_unsupported;
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags,
+             ...) {
+    va_list args;
+    va_start(args, flags);
+    void *new_address = va_arg(args, void *);
+    va_end(args);
+
+    mremap_calls++;
+    if (mremap_unsupported) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    return (void *)syscall(SYS_mremap, old_address, old_size, new_size, flags,
+                           new_address);
+}
+
+// Write a different value to every page, and to the last byte
+static void fill_pages(char *p, size_t size, char seed) {
+    for (size_t i = 0; i < size; i += 4096) {
+        p[i] = seed + i / 4096;
+    }
+    p[size - 1] = seed;
+}
+
+static int pages_filled(const char *p, size_t size, char seed) {
+    for (size_t i = 0; i < size; i += 4096) {
+        if (p[i] != (char)(seed + i / 4096)) {
+            return 0;
+        }
+    }
+    return p[size - 1] == seed;
+}
+
+// Test: Reallocations of low-fat allocations beyond MIRT_LF_MREMAP_THRESHOLD
+// move the pages, and the old slot stays usable. If the kernel does not
+// support this, they are copied from then on.
+int test_realloc_move(void) {
+    size_t size = 2 * MIRT_LF_MREMAP_THRESHOLD - 1;
+    // Pages are only moved between regions without huge pages here
+    for (size_t factor = 1; factor <= 8; factor *= 2) {
+        uint64_t index = __lowfat_index_for_size(factor * size + 1);
+        if (HEAP_REGION_HUGE_PAGES[__lowfat_get_zero_based_index(index)] !=
+            HUGE_PAGES_NONE) {
+            return 0;
+        }
+    }
+
+    char *p = malloc(size);
+    fill_pages(p, size, 1);
+    mremap_calls = 0;
+    char *q = realloc(p, 2 * size);
+    if (!__is_lowfat(q) || mremap_calls != 1 || !pages_filled(q, size, 1)) {
+        printf("Reallocation did not move the pages\n");
+        return 1;
+    }
+
+    // The old slot is reused first, and is still mapped
+    char *reused = malloc(size);
+    if (reused != p) {
+        printf("The moved slot was not reused\n");
+        return 1;
+    }
+    fill_pages(reused, size, 2);
+    free(reused);
+
+    mremap_unsupported = 1;
+    fill_pages(q, 2 * size, 3);
+    char *r = realloc(q, 4 * size);
+    if (!__is_lowfat(r) || mremap_calls != 2 || !pages_filled(r, 2 * size, 3)) {
+        printf("Reallocation did not copy the pages without mremap\n");
+        return 1;
+    }
+    char *s = realloc(r, 8 * size);
+    if (!__is_lowfat(s) || mremap_calls != 2 || !pages_filled(s, 2 * size, 3)) {
+        printf("Reallocation tried mremap again\n");
+        return 1;
+    }
+    mremap_unsupported = 0;
+    free(s);
+    return 0;
+}
+
+// Test: Sizes between two powers of two get their own classes. With four
+// classes per power of two, 65 bytes (a 64 byte request plus the padding byte)
+// get an 80 byte slot, and 81 bytes a 96 byte slot.
+int test_sub_classes(void) {
+#if HEAP_CLASSES_PER_POWER_OF_TWO == 4
+    size_t sizes[][2] = {{65, 80}, {81, 96}};
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64_t index = __lowfat_index_for_size(sizes[i][0]);
+        if (__lowfat_ptr_size(index) != sizes[i][1]) {
+            printf("Size %lu got class size %lu instead of %lu\n",
+                   sizes[i][0], __lowfat_ptr_size(index), sizes[i][1]);
+            return 1;
+        }
+
+        char *p = malloc(sizes[i][0] - 1);
+        char *last = p + sizes[i][0] - 2;
+        if (__lowfat_ptr_index(p) != index ||
+            (char *)__lowfat_ptr_base_without_index(last) != p) {
+            printf("Allocation of size %lu has the wrong index or base\n",
+                   sizes[i][0] - 1);
+            return 1;
+        }
+        free(p);
+    }
+#endif
+    return 0;
+}
+
+#define STACK_PART_BASE                                                        \
+    (BASE_STACK_REGION_NUM * REGION_SIZE + STACK_REGION_OFFSET)
+#define THREAD_STACKS_BASE (STACK_PART_BASE + STACK_SIZE)
+
+// The mirror of a stack address in the stack part of the first region
+static volatile int *stack_mirror(uintptr_t address) {
+    return (volatile int *)(REGION_SIZE + STACK_REGION_OFFSET + address -
+                            STACK_PART_BASE);
+}
+
+// Stores the address of a local variable in *arg, and writes to its mirror.
+// Returns NULL if the mirror did not start out zero.
+static void *use_thread_stack(void *arg) {
+    volatile int local = 0;
+    volatile int *mirror = stack_mirror((uintptr_t)&local);
+    int fresh = *mirror == 0;
+    *mirror = 1;
+    __atomic_store_n((uintptr_t *)arg, (uintptr_t)&local, __ATOMIC_RELEASE);
+    return fresh ? arg : NULL;
+}
+
+// Returns the thread stack slot of the address, or -1 if it is not on a
+// low-fat thread stack
+static long thread_stack_slot(uintptr_t address) {
+    if (address < THREAD_STACKS_BASE ||
+        address >= STACK_PART_BASE + STACK_REGION_SIZE) {
+        return -1;
+    }
+    return (address - THREAD_STACKS_BASE) / MIRT_LF_THREAD_STACK_SIZE;
+}
+
+// Test: Threads run on low-fat stacks, which are reused once the thread was
+// joined, with their mirror cleared. Stacks of detached threads are never
+// reused.
+int test_thread_stacks(void) {
+#if (STACK_REGION_SIZE - STACK_SIZE) / MIRT_LF_THREAD_STACK_SIZE > 0
+    pthread_t thread;
+    uintptr_t joined = 0, timed_joined = 0, detached = 0, after_detached = 0;
+    void *res;
+
+    pthread_create(&thread, NULL, use_thread_stack, &joined);
+    pthread_join(thread, &res);
+    long slot = thread_stack_slot(joined);
+    if (slot < 0 || res == NULL) {
+        printf("Thread did not run on a fresh low-fat stack\n");
+        return 1;
+    }
+    if (*stack_mirror(joined) != 0) {
+        printf("The mirror of a joined thread's stack was not cleared\n");
+        return 1;
+    }
+
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += 60;
+    pthread_create(&thread, NULL, use_thread_stack, &timed_joined);
+    pthread_timedjoin_np(thread, &res, &timeout);
+    if (thread_stack_slot(timed_joined) != slot || res == NULL) {
+        printf("The stack of a joined thread was not reused\n");
+        return 1;
+    }
+
+    pthread_create(&thread, NULL, use_thread_stack, &detached);
+    pthread_detach(thread);
+    while (__atomic_load_n(&detached, __ATOMIC_ACQUIRE) == 0) {
+        sched_yield();
+    }
+    pthread_create(&thread, NULL, use_thread_stack, &after_detached);
+    pthread_join(thread, &res);
+    if (thread_stack_slot(detached) != slot ||
+        thread_stack_slot(after_detached) == slot) {
+        printf("The stack of a detached thread was reused\n");
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// Test: The heap regions are reserved at startup, so other mappings cannot be
+// placed in those that are not used yet
+int test_heap_reservation(void) {
+    // The largest class is not used by any other test
+    uintptr_t base = __lowfat_heap_region_base(NUM_HEAP_REGIONS - 1);
+    size_t len = sysconf(_SC_PAGESIZE);
+    void *fixed = mmap((void *)base, len, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (fixed != MAP_FAILED || errno != EEXIST) {
+        printf("heap reservation: mapped over the unused heap region %p\n",
+               (void *)base);
+        return 1;
+    }
+    void *hinted = mmap((void *)base, len, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (hinted == MAP_FAILED) {
+        printf("heap reservation: mmap failed\n");
+        return 1;
+    }
+    munmap(hinted, len);
+    if (hinted == (void *)base) {
+        printf("heap reservation: hint placed a mapping at %p\n",
+               (void *)base);
+        return 1;
+    }
+    return 0;
+}
+
+static int is_zero_memory(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether any page of the (at most 16 pages large) memory is resident
+static int any_page_resident(void *p, size_t len) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    unsigned char resident[16];
+    size_t num_pages = (len + page_size - 1) / page_size;
+    if (num_pages > 16 || mincore(p, num_pages * page_size, resident) != 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+        if (resident[i] & 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// calloc returns zeroed memory for the given page-multiple size class. If
+// untouched is set, the memory must be zero without calloc touching it.
+static int calloc_zeroed(size_t size, size_t num, int untouched,
+                         const char *name) {
+    for (size_t i = 0; i < num; i++) {
+        char *p = calloc(1, size);
+        if (untouched && any_page_resident(p, size)) {
+            printf("calloc (%s): pages of %p were touched\n", name, p);
+            return 1;
+        }
+        if (!is_zero_memory(p, size)) {
+            printf("calloc (%s): %p is not zero\n", name, p);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Test: calloc returns zeroed memory from fresh space, from slots that were
+// skipped for an aligned allocation, from reused slots and from decommitted
+// slots, and only clears the memory itself if it was used before
+int test_calloc_zero(void) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = 5 * page_size - 1;
+    uint64_t index = __lowfat_index_for_size(size + 1);
+    size_t slot_size = __lowfat_ptr_size(index);
+    if (slot_size % page_size != 0) {
+        return 0;
+    }
+    // Huge pages might be resident without being touched
+    int untouched = HEAP_REGION_HUGE_PAGES[__lowfat_get_zero_based_index(
+                        index)] == HUGE_PAGES_NONE;
+
+    // Skips the fresh slots before the next aligned one
+    char *first = malloc(size);
+    void *aligned;
+    if (posix_memalign(&aligned, 1 << 20, size) != 0) {
+        printf("calloc: aligned allocation failed\n");
+        return 1;
+    }
+    if (calloc_zeroed(size, 8, untouched, "skipped slots")) {
+        return 1;
+    }
+
+    memset(first, 0xff, size);
+    free(first);
+    if (calloc_zeroed(size, 1, 0, "reused slot")) {
+        return 1;
+    }
+
+    // The slots are decommitted with the last free. The array of them is
+    // mapped separately, as it might have the same size class.
+    size_t num = MIRT_LF_DECOMMIT_THRESHOLD / slot_size + 1;
+    char **ptrs = mmap(NULL, num * sizeof(char *), PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    for (size_t i = 0; i < num; i++) {
+        ptrs[i] = malloc(size);
+        memset(ptrs[i], 0xff, size);
+    }
+    for (size_t i = 0; i < num; i++) {
+        free(ptrs[i]);
+    }
+    munmap(ptrs, num * sizeof(char *));
+    return calloc_zeroed(size, num, untouched, "decommitted slots");
+}
+
+// Forks while a local variable has a value in the mirror, and lets parent and
+// child write to it in turn. Returns 1 if the child failed to see the value
+// from before the fork, or if one of them saw the other's write.
+static int fork_with_stack_object(void) {
+    volatile int local = 0;
+    if ((uintptr_t)&local - STACK_PART_BASE >= STACK_REGION_SIZE) {
+        // A regular stack, nothing is mirrored
+        return 0;
+    }
+    volatile int *mirror = stack_mirror((uintptr_t)&local);
+    // The same object seen through the stack part of the next region
+    volatile int *alias = (volatile int *)((uintptr_t)mirror + REGION_SIZE);
+
+    int to_child[2], to_parent[2];
+    if (pipe(to_child) != 0 || pipe(to_parent) != 0) {
+        printf("fork: could not create the pipes\n");
+        return 1;
+    }
+    *mirror = 1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("fork: fork failed\n");
+        return 1;
+    }
+    // Either side sees the other one exit if it does not reach the next step
+    close(pid == 0 ? to_child[1] : to_child[0]);
+    close(pid == 0 ? to_parent[0] : to_parent[1]);
+    char token = 0;
+    if (pid == 0) {
+        int ok = *alias == 1;
+        *mirror = 2;
+        ok = ok && *alias == 2 && write(to_parent[1], &token, 1) == 1;
+        // The parent writes to its object in the meantime
+        ok = ok && read(to_child[0], &token, 1) == 1 && *alias == 2;
+        _exit(ok ? 0 : 1);
+    }
+
+    int failed = 0;
+    int child_waiting = read(to_parent[0], &token, 1) == 1;
+    if (*alias != 1) {
+        printf("fork: the parent saw the write of the child\n");
+        failed = 1;
+    }
+    *mirror = 3;
+    if (child_waiting && write(to_child[1], &token, 1) != 1) {
+        failed = 1;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        printf("fork: the child did not get its own copy of the stack\n");
+        failed = 1;
+    }
+    if (*alias != 3) {
+        printf("fork: the parent lost its own write\n");
+        failed = 1;
+    }
+    *mirror = 0;
+    close(to_child[1]);
+    close(to_parent[0]);
+    return failed;
+}
+
+static void *fork_from_thread(void *arg) {
+    (void)arg;
+    return fork_with_stack_object() ? NULL : arg;
+}
+
+static void *wait_for_release(void *arg) {
+    char token;
+    // Returns once the write end is closed
+    while (read(*(int *)arg, &token, 1) > 0) {
+    }
+    return NULL;
+}
+
+// Test: A forked child gets its own copy of the objects on the stack, also if
+// the parent has several threads, and if it forks on a thread stack
+int test_fork_stack(void) {
+    if (fork_with_stack_object()) {
+        return 1;
+    }
+
+    int release[2];
+    if (pipe(release) != 0) {
+        printf("fork: could not create the pipe\n");
+        return 1;
+    }
+    pthread_t idle, forking;
+    pthread_create(&idle, NULL, wait_for_release, &release[0]);
+    int failed = fork_with_stack_object();
+    void *res;
+    pthread_create(&forking, NULL, fork_from_thread, &release);
+    pthread_join(forking, &res);
+    close(release[1]);
+    pthread_join(idle, NULL);
+    close(release[0]);
+    return failed || res == NULL;
+}
+
+// Test: Once the region of a size is full, its allocations spill into an
+// overflow bank. They keep the size and base of the primary region.
+int test_overflow_bank(void) {
+#if HEAP_OVERFLOW_BANKS > 0
+    // The pages of the allocations are never touched
+    size_t size = (1UL << 27) - 1;
+    uint64_t primary_index = __lowfat_index_for_size(size + 1);
+    size_t per_region = HEAP_REGION_SIZE / (size + 1);
+    char **ptrs = malloc((per_region + 1) * sizeof(char *));
+    for (size_t i = 0; i <= per_region; i++) {
+        ptrs[i] = malloc(size);
+    }
+
+    char *spilled = ptrs[per_region];
+    uint64_t index = __lowfat_ptr_index(spilled);
+    int failed = 0;
+    if (!__is_lowfat(spilled) || index == primary_index) {
+        printf("Allocation did not spill into an overflow bank\n");
+        failed = 1;
+    } else if (__lowfat_ptr_size(index) != size + 1 ||
+               (char *)__lowfat_ptr_base_without_index(spilled + 12345) !=
+                   spilled) {
+        printf("Allocation in an overflow bank has the wrong size or base\n");
+        failed = 1;
+    }
+
+    for (size_t i = 0; i <= per_region; i++) {
+        free(ptrs[i]);
+    }
+    free(ptrs);
+    return failed;
+#else
+    return 0;
+#endif
+}
+
+// Run test in a child process, as failing checks abort. Returns 1 iff the
+// child did not exit successfully.
+static int fails_in_child(void (*test)(void)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Keep the output of the expected failures out of the test log
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        test();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+// Both have a 64 byte slot, of which the last byte is padding
+static char *checked_dst, *checked_src;
+
+static void checked_in_bounds(void) {
+    __lowfat_memcpy(checked_dst, checked_src, 64);
+    __lowfat_memmove(checked_dst + 1, checked_dst, 63);
+    __lowfat_memset(checked_dst, 'x', 63);
+    checked_dst[63] = '\0';
+    __lowfat_strcpy(checked_src, checked_dst);
+    __lowfat_strncpy(checked_dst, checked_src, 64);
+}
+
+static void checked_memcpy_dst(void) {
+    __lowfat_memcpy(checked_dst, checked_src, 65);
+}
+
+static void checked_memcpy_src(void) {
+    char *large = malloc(1000);
+    __lowfat_memcpy(large, checked_src + 10, 60);
+}
+
+static void checked_memmove(void) {
+    __lowfat_memmove(checked_dst + 1, checked_dst, 64);
+}
+
+static void checked_memset(void) { __lowfat_memset(checked_dst + 60, 0, 5); }
+
+static void checked_strcpy_dst(void) {
+    char *large = malloc(500);
+    memset(large, 'y', 100);
+    large[100] = '\0';
+    __lowfat_strcpy(checked_dst, large);
+}
+
+static void checked_strcpy_src(void) {
+    // Without a terminator in bounds, strcpy reads past the allocation
+    memset(checked_src, 'z', 64);
+    char *large = malloc(500);
+    __lowfat_strcpy(large, checked_src);
+}
+
+static void checked_strncpy(void) { __lowfat_strncpy(checked_dst, "x", 65); }
+
+// Test: The checked memory and string functions fail for out-of-bounds
+// accesses to either of their arguments
+int test_checked_functions(void) {
+    checked_dst = malloc(63);
+    checked_src = malloc(63);
+    memset(checked_src, 'q', 64);
+    if (fails_in_child(checked_in_bounds)) {
+        printf("Checked functions failed for in-bounds accesses\n");
+        return 1;
+    }
+
+    void (*out_of_bounds[])(void) = {
+        checked_memcpy_dst, checked_memcpy_src, checked_memmove,
+        checked_memset,     checked_strcpy_dst, checked_strcpy_src,
+        checked_strncpy};
+    for (unsigned i = 0; i < sizeof(out_of_bounds) / sizeof(out_of_bounds[0]);
+         i++) {
+        if (!fails_in_child(out_of_bounds[i])) {
+            printf("Checked function %u missed an out-of-bounds access\n", i);
+            return 1;
+        }
+    }
+    free(checked_dst);
+    free(checked_src);
+    return 0;
+}
+
+// Test: reallocarray fails with ENOMEM if the size overflows, and keeps the
+// original allocation
+int test_reallocarray_overflow(void) {
+    char *p = malloc(16);
+    // Hide the overflow from the compiler, which warns about it
+    volatile size_t count = SIZE_MAX / 2;
+    errno = 0;
+    if (reallocarray(p, count, 3) != NULL || errno != ENOMEM) {
+        printf("reallocarray did not detect the overflow\n");
+        return 1;
+    }
+    free(p);
+    return 0;
+}
+
+// Only declared by C libraries that implement C23
+void free_sized(void *ptr, size_t size);
+
+static void sized_free_matching(void) { free_sized(malloc(100), 100); }
+
+static void sized_free_too_large(void) { free_sized(malloc(100), 500); }
+
+static void sized_free_beyond_heap_sizes(void) {
+    free_sized(malloc(100), MAX_HEAP_ALLOC_SIZE * 2);
+}
+
+// Test: free_sized fails if the size does not fit the low-fat allocation, also
+// for sizes that no low-fat allocation can have
+int test_sized_free(void) {
+    if (fails_in_child(sized_free_matching)) {
+        printf("free_sized failed for the allocated size\n");
+        return 1;
+    }
+    if (!fails_in_child(sized_free_too_large) ||
+        !fails_in_child(sized_free_beyond_heap_sizes)) {
+        printf("free_sized missed a size mismatch\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Test: Batch allocations are distinct low-fat objects of the requested size,
+// and freeing them as a batch makes their slots available again
+int test_batch_allocation(void) {
+    enum { NUM_OBJECTS = 100 };
+    void *objects[NUM_OBJECTS];
+    if (__lowfat_malloc_batch(40, NUM_OBJECTS, objects) != NUM_OBJECTS) {
+        printf("Batch allocation returned too few objects\n");
+        return 1;
+    }
+    uint64_t index = __lowfat_index_for_size(41);
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        if (!__is_lowfat(objects[i]) ||
+            __lowfat_ptr_index(objects[i]) != index ||
+            (i > 0 && objects[i] == objects[i - 1])) {
+            printf("Batch allocation returned a wrong object\n");
+            return 1;
+        }
+        memset(objects[i], 1, 40);
+    }
+
+    // NULL entries are skipped
+    void *skipped = objects[NUM_OBJECTS / 2];
+    objects[NUM_OBJECTS / 2] = NULL;
+    __lowfat_free_batch(objects, NUM_OBJECTS);
+    void *reused = malloc(40);
+    int found = 0;
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        found |= objects[i] == reused;
+    }
+    if (!found) {
+        printf("Batch free did not make the slots available\n");
+        return 1;
+    }
+    free(reused);
+    free(skipped);
+    return 0;
+}
+
 int main(void) {
+    if (test_aligned_reuse() || test_large_alignment() ||
+        test_realloc_in_place() || test_realloc_move() || test_sub_classes() ||
+        test_thread_stacks() || test_heap_reservation() ||
+        test_calloc_zero() || test_fork_stack() || test_overflow_bank() ||
+        test_checked_functions() || test_reallocarray_overflow() ||
+        test_sized_free() || test_batch_allocation()) {
+        return 1;
+    }
+
     printf("\nIf this test succeeds, you will see a beautiful bug below!\n\n");
     return test_basic_check();
 }
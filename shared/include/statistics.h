@@ -27,6 +27,9 @@
  *          printed (i.e. appended) to a file with the name s.
  *      MIRT_STATS_COUNTER_DEFS - Defines the name of the file in which counter
  *          definitions are given, should be in the include path.
+ *      MIRT_STATS_EXTRA_PRINTER - If this is defined (as the name of a
+ *          function void f(FILE *dest)), the function is called after the
+ *          counters are printed to add mechanism-specific statistics.
  *
  * Independently of whether MIRT_STATISTICS is set, this header declares the
  * __get_prog_name() function that returns the absolute path of the binary as a
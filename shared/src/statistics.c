@@ -58,6 +58,10 @@ static struct __StatEntry {
 
 static size_t __NumStatEntries = __COUNTER__;
 
+#ifdef MIRT_STATS_EXTRA_PRINTER
+void MIRT_STATS_EXTRA_PRINTER(FILE *dest);
+#endif
+
 static void __print_stats(void) {
     // make sure that no more stat increments are generated
     __mi_disable_stats();
@@ -79,6 +83,10 @@ static void __print_stats(void) {
                 *__StatRegistry[i].ptr);
     }
 
+#ifdef MIRT_STATS_EXTRA_PRINTER
+    MIRT_STATS_EXTRA_PRINTER(dest);
+#endif
+
     fprintf(dest, "==================================================\n");
     fclose(dest);
 }
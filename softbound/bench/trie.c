@@ -0,0 +1,239 @@
+// Microbenchmark for the geometry of the metadata trie, built once for every
+// size of the secondary tables (bench_trie_<bits>, with <bits> the value of
+// __SOFTBOUNDCETS_TRIE_SECONDARY_BITS).
+//
+// Metadata is stored for and then loaded from several layouts of pointer
+// locations:
+//  - dense: consecutive pointers (an array of pointers)
+//  - nodes: one pointer per 64 byte node, visited in random order (a list)
+//  - pages: one pointer per 4 KiB page (large nodes)
+//  - sparse: pointers at random locations in 1 TiB (scattered heaps)
+// The addresses are only used as keys, they are never dereferenced. For every
+// layout, it reports the time per store and load, the page faults and the
+// memory (resident and reserved) for the stores, and the dTLB misses per load
+// (if the kernel allows to count them).
+//
+// Usage: bench_trie_<bits> [pointers]
+
+#include "softboundcets_common.h"
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Start of the (fake) address range the pointers are stored in
+#define RANGE_BASE ((size_t)1 << 40)
+#define SPARSE_RANGE ((size_t)1 << 40)
+
+// Usually called by the instrumentation
+void __softboundcets_init(void);
+
+__attribute__((constructor)) static void init_runtime(void) {
+    __softboundcets_init();
+}
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+static volatile size_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void shuffle(size_t *addrs, size_t n) {
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = next_random() % (i + 1);
+        size_t tmp = addrs[i];
+        addrs[i] = addrs[j];
+        addrs[j] = tmp;
+    }
+}
+
+static size_t init_dense(size_t *addrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        addrs[i] = RANGE_BASE + i * sizeof(void *);
+    }
+    return n;
+}
+
+static size_t init_nodes(size_t *addrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        addrs[i] = RANGE_BASE + i * 64;
+    }
+    shuffle(addrs, n);
+    return n;
+}
+
+static size_t init_pages(size_t *addrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        addrs[i] = RANGE_BASE + i * 4096;
+    }
+    return n;
+}
+
+static size_t init_sparse(size_t *addrs, size_t n) {
+    // Every pointer likely needs a secondary table of its own for large
+    // tables, so use fewer of them
+    n = n / 64 ? n / 64 : 1;
+    for (size_t i = 0; i < n; i++) {
+        addrs[i] = RANGE_BASE + (next_random() % SPARSE_RANGE & ~(size_t)7);
+    }
+    return n;
+}
+
+static void store(size_t addr, size_t value) {
+#if __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_store((void *)addr, (void *)value,
+                                   (void *)(value + 1));
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_store((void *)addr, value, (lock_type)value);
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_metadata_store((void *)addr, (void *)value,
+                                   (void *)(value + 1), value,
+                                   (lock_type)value);
+#endif
+}
+
+static size_t load(size_t addr) {
+#if __SOFTBOUNDCETS_SPATIAL
+    void *base, *bound;
+    __softboundcets_metadata_load((void *)addr, &base, &bound);
+    return (size_t)base;
+#elif __SOFTBOUNDCETS_TEMPORAL
+    key_type key;
+    lock_type lock;
+    __softboundcets_metadata_load((void *)addr, &key, &lock);
+    return key;
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    void *base, *bound;
+    key_type key;
+    lock_type lock;
+    __softboundcets_metadata_load((void *)addr, &base, &bound, &key, &lock);
+    return key;
+#endif
+}
+
+// Virtual and resident size of the process in MiB
+static void memory_usage(double *virtual_mib, double *resident_mib) {
+    long virtual_pages = 0, resident_pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &virtual_pages, &resident_pages) != 2) {
+            virtual_pages = resident_pages = 0;
+        }
+        fclose(statm);
+    }
+    double page_mib = (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+    *virtual_mib = virtual_pages * page_mib;
+    *resident_mib = resident_pages * page_mib;
+}
+
+static long minor_faults(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// A counter for dTLB load misses of this thread, or -1 if not permitted
+static int open_dtlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static const struct {
+    const char *name;
+    size_t (*init)(size_t *, size_t);
+} layouts[] = {
+    {"dense", init_dense},
+    {"nodes", init_nodes},
+    {"pages", init_pages},
+    {"sparse", init_sparse},
+};
+
+int softboundcets_pseudo_main(int argc, char **argv) {
+    size_t pointers = argc > 1 ? strtoul(argv[1], NULL, 10) : (1 << 18);
+    if (pointers == 0) {
+        fprintf(stderr, "Usage: %s [pointers]\n", argv[0]);
+        return 1;
+    }
+
+    size_t *addrs = malloc(pointers * sizeof(size_t));
+    int dtlb = open_dtlb_counter();
+
+    printf("%-7s %-5s %10s %10s %10s %10s %12s %10s\n", "layout", "bits",
+           "ns/store", "ns/load", "faults", "rss MiB", "reserved MiB",
+           "dtlb/load");
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        size_t n = layouts[l].init(addrs, pointers);
+
+        double virtual_before, resident_before, virtual_after, resident_after;
+        memory_usage(&virtual_before, &resident_before);
+        long faults = minor_faults();
+
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            store(addrs[i], i + 1);
+        }
+        uint64_t store_time = now_ns() - start;
+
+        faults = minor_faults() - faults;
+        memory_usage(&virtual_after, &resident_after);
+
+        uint64_t misses = 0;
+        if (dtlb >= 0) {
+            ioctl(dtlb, PERF_EVENT_IOC_RESET, 0);
+            ioctl(dtlb, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        start = now_ns();
+        size_t sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += load(addrs[i]);
+        }
+        uint64_t load_time = now_ns() - start;
+        if (dtlb >= 0) {
+            ioctl(dtlb, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(dtlb, &misses, sizeof(misses)) != sizeof(misses)) {
+                misses = 0;
+            }
+        }
+        sink = sum;
+
+        char dtlb_str[16] = "n/a";
+        if (dtlb >= 0) {
+            snprintf(dtlb_str, sizeof(dtlb_str), "%.3f",
+                     (double)misses / (double)n);
+        }
+        printf("%-7s %-5d %10.2f %10.2f %10ld %10.1f %12.1f %10s\n",
+               layouts[l].name, __SOFTBOUNDCETS_TRIE_SECONDARY_BITS,
+               (double)store_time / (double)n, (double)load_time / (double)n,
+               faults, resident_after - resident_before,
+               virtual_after - virtual_before, dtlb_str);
+    }
+
+    free(addrs);
+    return 0;
+}
@@ -3,6 +3,7 @@
 Generates C++ header which contains information on the C-runtime config.
 """
 import os
+import re
 import argparse
 from pathlib import Path
 
@@ -44,12 +45,40 @@ def compute_defines(feature_file, features, verbose):
     return translate_to_CXX(feature_set)
 
 
-def generate_config_info(feature_file, features, out_file_name, verbose):
+def compute_parameters(feature_file, defaults_file, parameters, verbose):
     """
-    Find the defined features and write them to the C++ header.
+    Find the values of all numeric parameters and translate them to C++
+    defines. Parameters not set on the command line get the default value
+    from the defaults file.
+    """
+    with open(feature_file) as open_file:
+        file_content = open_file.read()
+    with open(defaults_file) as open_file:
+        defaults_content = open_file.read()
+
+    result = ""
+    for parameter in parameters:
+        match = re.search(rf"-D{parameter}=(\d+)", file_content)
+        if not match:
+            match = re.search(rf"#define {parameter} (\d+)", defaults_content)
+        if not match:
+            raise ValueError(f"No value found for parameter {parameter}")
+        if verbose:
+            print(f"Parameter {parameter}: {match.group(1)}")
+        result += f"#define {parameter} {match.group(1)}\n"
+
+    return result
+
+
+def generate_config_info(feature_file, features, defaults_file, parameters,
+                         out_file_name, verbose):
+    """
+    Find the defined features and parameters and write them to the C++ header.
     """
     file_name = out_file_name.split("include/")[-1]
     defines = compute_defines(feature_file, features, verbose)
+    defines += compute_parameters(feature_file,
+                                  defaults_file, parameters, verbose)
 
     include_guard = "SB_RT_CONFIG_INFO"
     namespace = ["meminstrument", "softbound"]
@@ -96,7 +125,13 @@ def main():
                 "__SOFTBOUNDCETS_SPATIAL_TEMPORAL",
                 "MIRT_STATISTICS"]
 
-    generate_config_info(feature_file, features, out_file_name, args.verbose)
+    # Defines all numeric parameters that should be communicated to the C++
+    # Pass, together with the header that holds their default values.
+    defaults_file = "src/softboundcets_defines.h"
+    parameters = ["__SOFTBOUNDCETS_TRIE_SECONDARY_BITS"]
+
+    generate_config_info(feature_file, features, defaults_file, parameters,
+                         out_file_name, args.verbose)
 
 
 if __name__ == "__main__":
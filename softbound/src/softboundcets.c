@@ -24,9 +24,9 @@ extern char **environ;
 
 __softboundcets_trie_entry_t **__softboundcets_trie_primary_table;
 
-shadow_stack_ptr_type __softboundcets_shadow_stack_ptr = NULL;
+_Thread_local shadow_stack_ptr_type __softboundcets_shadow_stack_ptr = NULL;
 
-shadow_stack_ptr_type __softboundcets_shadow_stack_max = NULL;
+_Thread_local shadow_stack_ptr_type __softboundcets_shadow_stack_max = NULL;
 
 static int softboundcets_initialized = 0;
 
@@ -46,21 +46,9 @@ void __softboundcets_init(void) {
     __softboundcets_temporal_initialize_datastructures();
 #endif
 
-    size_t shadow_stack_size =
-        __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES * sizeof(size_t);
-    __softboundcets_shadow_stack_ptr =
-        mmap(0, shadow_stack_size, PROT_READ | PROT_WRITE,
-             SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
-    assert(__softboundcets_shadow_stack_ptr != (void *)-1);
-
-    // Keep track of the limit of the shadow stack
-    __softboundcets_shadow_stack_max =
-        __softboundcets_shadow_stack_ptr + __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES;
-
-    *__softboundcets_shadow_stack_ptr = 0; /* prev stack size */
-    shadow_stack_ptr_type current_size_shadow_stack_ptr =
-        __softboundcets_shadow_stack_ptr + 1;
-    *(current_size_shadow_stack_ptr) = 0;
+    // The shadow stack of the main thread, other threads get theirs in the
+    // pthread_create wrapper or on their first use of it
+    __softboundcets_shadow_stack_create();
 
     size_t length_trie = (__SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES) *
                          sizeof(__softboundcets_trie_entry_t *);
@@ -76,33 +64,38 @@ void __softboundcets_init(void) {
 
 void __softboundcets_update_environment_metadata() {
     char *const *envPtr = environ;
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    // The environment stays valid for the whole execution, like globals
+    key_type env_key = 1;
+    lock_type env_lock = __softboundcets_get_global_lock();
+#endif
     while (*envPtr != NULL) {
         // Store the length for individual environment variable
 #if __SOFTBOUNDCETS_SPATIAL
         __softboundcets_metadata_store(envPtr, *envPtr,
                                        *envPtr + strlen(*envPtr) + 1);
 #elif __SOFTBOUNDCETS_TEMPORAL
-        __mi_fail_with_msg(
-            "Missing implementation for enviornment variable access");
+        __softboundcets_metadata_store(envPtr, env_key, env_lock);
 #elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
-        __mi_fail_with_msg(
-            "Missing implementation for enviornment variable access");
+        __softboundcets_metadata_store(envPtr, *envPtr,
+                                       *envPtr + strlen(*envPtr) + 1, env_key,
+                                       env_lock);
 #endif
         envPtr++;
     }
     // Determine the address one past the terminating NULL
     envPtr++;
 
-#if __SOFTBOUNDCETS_SPATIAL
     // Store the valid range of the environment
+#if __SOFTBOUNDCETS_SPATIAL
     __softboundcets_metadata_store(&environ, environ,
                                    environ + (envPtr - environ));
 #elif __SOFTBOUNDCETS_TEMPORAL
-    __mi_fail_with_msg(
-        "Missing implementation for enviornment variable access");
+    __softboundcets_metadata_store(&environ, env_key, env_lock);
 #elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
-    __mi_fail_with_msg(
-        "Missing implementation for enviornment variable access");
+    __softboundcets_metadata_store(&environ, environ,
+                                   environ + (envPtr - environ), env_key,
+                                   env_lock);
 #endif
 }
 
@@ -7,17 +7,101 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 
 extern __softboundcets_trie_entry_t **__softboundcets_trie_primary_table;
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+extern _Thread_local size_t *__softboundcets_stack_temporal_space_base;
+#endif
+
+void __softboundcets_shadow_stack_create(void) {
+    size_t shadow_stack_size =
+        __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES * sizeof(size_t);
+    __softboundcets_shadow_stack_ptr =
+        mmap(0, shadow_stack_size, PROT_READ | PROT_WRITE,
+             SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+    assert(__softboundcets_shadow_stack_ptr != (void *)-1);
+
+    // Keep track of the limit of the shadow stack
+    __softboundcets_shadow_stack_max =
+        __softboundcets_shadow_stack_ptr + __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES;
+
+    *__softboundcets_shadow_stack_ptr = 0; /* prev stack size */
+    shadow_stack_ptr_type current_size_shadow_stack_ptr =
+        __softboundcets_shadow_stack_ptr + 1;
+    *(current_size_shadow_stack_ptr) = 0;
+}
+
+void __softboundcets_shadow_stack_destroy(void) {
+    if (__softboundcets_shadow_stack_max == NULL) {
+        return;
+    }
+    munmap(__softboundcets_shadow_stack_max -
+               __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES,
+           __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES * sizeof(size_t));
+    __softboundcets_shadow_stack_ptr = NULL;
+    __softboundcets_shadow_stack_max = NULL;
+}
+
+// The value of this key counts the destructor rounds, the destructor releases
+// the shadow stack (and stack lock space) of a thread when it exits (also via
+// pthread_exit)
+static pthread_key_t thread_state_key;
+static pthread_once_t thread_state_key_once = PTHREAD_ONCE_INIT;
+
+// Destructors of other keys run in an unspecified order and may call
+// instrumented code. Setting the value again makes the destructor run in the
+// next round, so the state is only released in the last one.
+static void release_thread_state(void *value) {
+    uintptr_t round = (uintptr_t)value;
+    if (round < PTHREAD_DESTRUCTOR_ITERATIONS) {
+        pthread_setspecific(thread_state_key, (void *)(round + 1));
+        return;
+    }
+    __softboundcets_shadow_stack_destroy();
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_stack_temporal_space_destroy();
+    __softboundcets_release_thread_locks();
+#endif
+}
+
+static void create_thread_state_key(void) {
+    if (pthread_key_create(&thread_state_key, release_thread_state) != 0) {
+        __mi_fail_with_msg("Failed to create the thread state key\n");
+    }
+}
+
+void __softboundcets_thread_state_create(void) {
+    if (__softboundcets_shadow_stack_ptr == NULL) {
+        __softboundcets_shadow_stack_create();
+    }
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    if (__softboundcets_stack_temporal_space_base == NULL) {
+        __softboundcets_stack_temporal_space_create();
+    }
+#endif
+    pthread_once(&thread_state_key_once, create_thread_state_key);
+    if (pthread_getspecific(thread_state_key) == NULL) {
+        pthread_setspecific(thread_state_key, (void *)1);
+    }
+}
+
+__WEAK_INLINE shadow_stack_ptr_type __softboundcets_get_shadow_stack_ptr(void) {
+    if (__builtin_expect(__softboundcets_shadow_stack_ptr == NULL, 0)) {
+        __softboundcets_thread_state_create();
+    }
+    return __softboundcets_shadow_stack_ptr;
+}
 
 __WEAK_INLINE void
 __softboundcets_allocate_shadow_stack_space(int num_pointer_args) {
 
     shadow_stack_ptr_type prev_stack_size_ptr =
-        __softboundcets_shadow_stack_ptr + 1;
+        __softboundcets_get_shadow_stack_ptr() + 1;
     size_t prev_stack_size = *prev_stack_size_ptr;
 
     ssize_t size = num_pointer_args * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
@@ -65,6 +149,34 @@ __WEAK_INLINE __softboundcets_trie_entry_t *__softboundcets_trie_allocate() {
     return secondary_entry;
 }
 
+// Secondary tables are only ever installed with a compare-and-swap, such that
+// concurrent installs for the same index cannot lose the metadata stored into
+// one of the tables. Readers load the entries of the primary table with
+// acquire semantics, so they also observe the metadata that the installing
+// thread stored into the table before another thread picked it up.
+__WEAK_INLINE __softboundcets_trie_entry_t *
+__softboundcets_trie_secondary(size_t primary_index) {
+    return __atomic_load_n(&__softboundcets_trie_primary_table[primary_index],
+                           __ATOMIC_ACQUIRE);
+}
+
+__WEAK_INLINE __softboundcets_trie_entry_t *
+__softboundcets_trie_install_secondary(size_t primary_index) {
+
+    __softboundcets_trie_entry_t *secondary_table =
+        __softboundcets_trie_allocate();
+    __softboundcets_trie_entry_t *installed = NULL;
+    if (!__atomic_compare_exchange_n(
+            &__softboundcets_trie_primary_table[primary_index], &installed,
+            secondary_table, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Another thread was faster, use its table
+        munmap(secondary_table, __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES *
+                                    sizeof(__softboundcets_trie_entry_t));
+        return installed;
+    }
+    return secondary_table;
+}
+
 /* Metadata store parameterized by the mode of checking */
 
 #if __SOFTBOUNDCETS_SPATIAL
@@ -90,14 +202,13 @@ __METADATA_INLINE void __softboundcets_metadata_store(const void *addr_of_ptr,
     size_t primary_index;
     __softboundcets_trie_entry_t *trie_secondary_table;
 
-    primary_index = (ptr >> 25);
-    trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
+    primary_index = __softboundcets_trie_primary_index(ptr);
+    trie_secondary_table = __softboundcets_trie_secondary(primary_index);
 
 #if !__SOFTBOUNDCETS_PREALLOCATE_TRIE
     if (trie_secondary_table == NULL) {
-        trie_secondary_table = __softboundcets_trie_allocate();
-        __softboundcets_trie_primary_table[primary_index] =
-            trie_secondary_table;
+        trie_secondary_table =
+            __softboundcets_trie_install_secondary(primary_index);
     }
     __mi_debug_printf(
         "\t[metadata_store not prealloced] addr_of_ptr=%p, primary_index=%zx, "
@@ -106,7 +217,7 @@ __METADATA_INLINE void __softboundcets_metadata_store(const void *addr_of_ptr,
     assert(trie_secondary_table != NULL);
 #endif
 
-    size_t secondary_index = ((ptr >> 3) & 0x3fffff);
+    size_t secondary_index = __softboundcets_trie_secondary_index(ptr);
     __softboundcets_trie_entry_t *entry_ptr =
         &trie_secondary_table[secondary_index];
 
@@ -161,9 +272,9 @@ __METADATA_INLINE void __softboundcets_metadata_load(const void *addr_of_ptr,
 
     size_t ptr = (size_t)addr_of_ptr;
 
-    size_t primary_index = (ptr >> 25);
+    size_t primary_index = __softboundcets_trie_primary_index(ptr);
     __softboundcets_trie_entry_t *trie_secondary_table =
-        __softboundcets_trie_primary_table[primary_index];
+        __softboundcets_trie_secondary(primary_index);
 
 #if !__SOFTBOUNDCETS_PREALLOCATE_TRIE
     if (trie_secondary_table == NULL) {
@@ -181,7 +292,7 @@ __METADATA_INLINE void __softboundcets_metadata_load(const void *addr_of_ptr,
 #endif /* PREALLOCATE_ENDS */
 
     /* MAIN SOFTBOUNDCETS LOAD WHICH RUNS ON THE NORMAL MACHINE */
-    size_t secondary_index = ((ptr >> 3) & 0x3fffff);
+    size_t secondary_index = __softboundcets_trie_secondary_index(ptr);
     __softboundcets_trie_entry_t *entry_ptr =
         &trie_secondary_table[secondary_index];
 
@@ -221,11 +332,15 @@ void __softboundcets_copy_metadata(void *dest, const void *from, size_t size) {
 
     size_t from_ptr_end = from_ptr + size;
 
-    size_t dest_primary_index_begin = (dest_ptr >> 25);
-    size_t dest_primary_index_end = (dest_ptr_end >> 25);
+    size_t dest_primary_index_begin =
+        __softboundcets_trie_primary_index(dest_ptr);
+    size_t dest_primary_index_end =
+        __softboundcets_trie_primary_index(dest_ptr_end);
 
-    size_t from_primary_index_begin = (from_ptr >> 25);
-    size_t from_primary_index_end = (from_ptr_end >> 25);
+    size_t from_primary_index_begin =
+        __softboundcets_trie_primary_index(from_ptr);
+    size_t from_primary_index_end =
+        __softboundcets_trie_primary_index(from_ptr_end);
 
     if ((from_primary_index_begin != from_primary_index_end) ||
         (dest_primary_index_begin != dest_primary_index_end)) {
@@ -238,16 +353,18 @@ void __softboundcets_copy_metadata(void *dest, const void *from, size_t size) {
 
         for (index = 0; index < trie_size; index = index + 8) {
 
-            size_t temp_from_pindex = (from_sizet + index) >> 25;
-            size_t temp_to_pindex = (dest_sizet + index) >> 25;
+            size_t temp_from_pindex =
+                __softboundcets_trie_primary_index(from_sizet + index);
+            size_t temp_to_pindex =
+                __softboundcets_trie_primary_index(dest_sizet + index);
 
             size_t dest_secondary_index =
-                (((dest_sizet + index) >> 3) & 0x3fffff);
+                __softboundcets_trie_secondary_index(dest_sizet + index);
             size_t from_secondary_index =
-                (((from_sizet + index) >> 3) & 0x3fffff);
+                __softboundcets_trie_secondary_index(from_sizet + index);
 
             __softboundcets_trie_entry_t *temp_from_strie =
-                __softboundcets_trie_primary_table[temp_from_pindex];
+                __softboundcets_trie_secondary(temp_from_pindex);
 
             // In case no pointer data is stored in this memory area, we don't
             // need to copy any metadata
@@ -256,12 +373,11 @@ void __softboundcets_copy_metadata(void *dest, const void *from, size_t size) {
             }
 
             __softboundcets_trie_entry_t *temp_to_strie =
-                __softboundcets_trie_primary_table[temp_to_pindex];
+                __softboundcets_trie_secondary(temp_to_pindex);
 
             if (temp_to_strie == NULL) {
-                temp_to_strie = __softboundcets_trie_allocate();
-                __softboundcets_trie_primary_table[temp_to_pindex] =
-                    temp_to_strie;
+                temp_to_strie =
+                    __softboundcets_trie_install_secondary(temp_to_pindex);
             }
 
             void *dest_entry_ptr = &temp_to_strie[dest_secondary_index];
@@ -278,9 +394,9 @@ void __softboundcets_copy_metadata(void *dest, const void *from, size_t size) {
     // transferring all the data.
 
     __softboundcets_trie_entry_t *trie_secondary_table_dest_begin =
-        __softboundcets_trie_primary_table[dest_primary_index_begin];
+        __softboundcets_trie_secondary(dest_primary_index_begin);
     __softboundcets_trie_entry_t *trie_secondary_table_from_begin =
-        __softboundcets_trie_primary_table[from_primary_index_begin];
+        __softboundcets_trie_secondary(from_primary_index_begin);
 
     // In case no pointer data is stored in this memory area, we don't need to
     // copy any metadata
@@ -290,14 +406,15 @@ void __softboundcets_copy_metadata(void *dest, const void *from, size_t size) {
     // Allocate the secondary trie for the destination in case it does not yet
     // exist
     if (trie_secondary_table_dest_begin == NULL) {
-        trie_secondary_table_dest_begin = __softboundcets_trie_allocate();
-        __softboundcets_trie_primary_table[dest_primary_index_begin] =
-            trie_secondary_table_dest_begin;
+        trie_secondary_table_dest_begin =
+            __softboundcets_trie_install_secondary(dest_primary_index_begin);
     }
 
     // Compute the secondary indices
-    size_t dest_secondary_index = ((dest_ptr >> 3) & 0x3fffff);
-    size_t from_secondary_index = ((from_ptr >> 3) & 0x3fffff);
+    size_t dest_secondary_index =
+        __softboundcets_trie_secondary_index(dest_ptr);
+    size_t from_secondary_index =
+        __softboundcets_trie_secondary_index(from_ptr);
 
     assert(dest_secondary_index < __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES);
     assert(from_secondary_index < __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES);
@@ -325,19 +442,19 @@ __softboundcets_allocation_secondary_trie_allocate_range(void *initial_ptr,
 
     void *addr_of_ptr = initial_ptr;
     size_t start_addr_of_ptr = (size_t)addr_of_ptr;
-    size_t start_primary_index = start_addr_of_ptr >> 25;
+    size_t start_primary_index =
+        __softboundcets_trie_primary_index(start_addr_of_ptr);
 
     size_t end_addr_of_ptr = (size_t)((char *)initial_ptr + size);
-    size_t end_primary_index = end_addr_of_ptr >> 25;
+    size_t end_primary_index =
+        __softboundcets_trie_primary_index(end_addr_of_ptr);
 
     for (; start_primary_index <= end_primary_index; start_primary_index++) {
 
         __softboundcets_trie_entry_t *trie_secondary_table =
-            __softboundcets_trie_primary_table[start_primary_index];
+            __softboundcets_trie_secondary(start_primary_index);
         if (trie_secondary_table == NULL) {
-            trie_secondary_table = __softboundcets_trie_allocate();
-            __softboundcets_trie_primary_table[start_primary_index] =
-                trie_secondary_table;
+            __softboundcets_trie_install_secondary(start_primary_index);
         }
     }
 }
@@ -352,30 +469,26 @@ __softboundcets_allocation_secondary_trie_allocate(void *addr_of_ptr) {
 #endif
 
     size_t ptr = (size_t)addr_of_ptr;
-    size_t primary_index = (ptr >> 25);
-    //  size_t secondary_index = ((ptr >> 3) & 0x3fffff);
+    size_t primary_index = __softboundcets_trie_primary_index(ptr);
+    //  size_t secondary_index = __softboundcets_trie_secondary_index(ptr);
 
     __softboundcets_trie_entry_t *trie_secondary_table =
-        __softboundcets_trie_primary_table[primary_index];
+        __softboundcets_trie_secondary(primary_index);
 
     if (trie_secondary_table == NULL) {
-        trie_secondary_table = __softboundcets_trie_allocate();
-        __softboundcets_trie_primary_table[primary_index] =
-            trie_secondary_table;
+        __softboundcets_trie_install_secondary(primary_index);
     }
 
     __softboundcets_trie_entry_t *trie_secondary_table_second_entry =
-        __softboundcets_trie_primary_table[primary_index + 1];
+        __softboundcets_trie_secondary(primary_index + 1);
 
     if (trie_secondary_table_second_entry == NULL) {
-        __softboundcets_trie_primary_table[primary_index + 1] =
-            __softboundcets_trie_allocate();
+        __softboundcets_trie_install_secondary(primary_index + 1);
     }
 
     if (primary_index != 0 &&
-        (__softboundcets_trie_primary_table[primary_index - 1] == NULL)) {
-        __softboundcets_trie_primary_table[primary_index - 1] =
-            __softboundcets_trie_allocate();
+        (__softboundcets_trie_secondary(primary_index - 1) == NULL)) {
+        __softboundcets_trie_install_secondary(primary_index - 1);
     }
 
     return;
@@ -390,7 +503,7 @@ shadow_stack_ptr_type *__softboundcets_allocate_va_arg_proxy(int arg_no) {
 
     // Calculate the location to the arg_no metadata
     size_t offset = 2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
-    shadow_stack_ptr_type loc = __softboundcets_shadow_stack_ptr + offset;
+    shadow_stack_ptr_type loc = __softboundcets_get_shadow_stack_ptr() + offset;
 
     // Store the value in the proxy object
     *proxy = loc;
@@ -458,7 +571,8 @@ __softboundcets_load_proxy_shadow_stack(int arg_no) {
 
     assert(arg_no >= 0);
     size_t count = 2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
-    shadow_stack_ptr_type proxy_ptr = __softboundcets_shadow_stack_ptr + count;
+    shadow_stack_ptr_type proxy_ptr =
+        __softboundcets_get_shadow_stack_ptr() + count;
     shadow_stack_ptr_type *proxy = *((shadow_stack_ptr_type **)proxy_ptr);
     __mi_debug_printf(
         "Proxy loaded from shadow stack (location %i): %p (pointing to %p)\n",
@@ -525,8 +639,8 @@ void __softboundcets_proxy_metadata_load(const void *addr_of_ptr,
     size_t ptr = (size_t)addr_of_ptr;
     __softboundcets_trie_entry_t *trie_secondary_table;
 
-    size_t primary_index = (ptr >> 25);
-    trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
+    size_t primary_index = __softboundcets_trie_primary_index(ptr);
+    trie_secondary_table = __softboundcets_trie_secondary(primary_index);
 
 #if !__SOFTBOUNDCETS_PREALLOCATE_TRIE
     if (trie_secondary_table == NULL) {
@@ -536,7 +650,7 @@ void __softboundcets_proxy_metadata_load(const void *addr_of_ptr,
 #endif /* PREALLOCATE_ENDS */
 
     /* MAIN SOFTBOUNDCETS LOAD WHICH RUNS ON THE NORMAL MACHINE */
-    size_t secondary_index = ((ptr >> 3) & 0x3fffff);
+    size_t secondary_index = __softboundcets_trie_secondary_index(ptr);
     __softboundcets_trie_entry_t *entry_ptr =
         &trie_secondary_table[secondary_index];
 
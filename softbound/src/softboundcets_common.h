@@ -3,16 +3,32 @@
 
 #include "softboundcets_defines.h"
 
-// 2^23 entries each will be 8 bytes each
+// The number of low address bits resolved by a secondary table
+#define __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT                                     \
+    (3 + __SOFTBOUNDCETS_TRIE_SECONDARY_BITS)
+
+// 2^(48 - shift) entries each will be 8 bytes each
 static const size_t __SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES =
-    ((size_t)8 * (size_t)1024 * (size_t)1024);
+    (size_t)1 << (48 - __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT);
 
 static const size_t __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES =
     ((size_t)128 * (size_t)32);
 
-// each secondary entry has 2^ 22 entries
+// each secondary entry has 2^__SOFTBOUNDCETS_TRIE_SECONDARY_BITS entries
 static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES =
-    ((size_t)4 * (size_t)1024 * (size_t)1024);
+    (size_t)1 << __SOFTBOUNDCETS_TRIE_SECONDARY_BITS;
+
+// The index into the primary table for the pointer stored at the given address
+static inline size_t __softboundcets_trie_primary_index(size_t addr_of_ptr) {
+    return addr_of_ptr >> __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT;
+}
+
+// The index into the secondary table for the pointer stored at the given
+// address
+static inline size_t __softboundcets_trie_secondary_index(size_t addr_of_ptr) {
+    return (addr_of_ptr >> 3) &
+           (((size_t)1 << __SOFTBOUNDCETS_TRIE_SECONDARY_BITS) - 1);
+}
 
 /* Layout of the shadow stack
 
@@ -26,12 +42,37 @@ static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES =
   new current stack size field; Deallocation: read the previous size,
   and decrement the shadow_stack_ptr */
 
+// Set up an empty shadow stack for the calling thread
+void __softboundcets_shadow_stack_create(void);
+
+// Release the shadow stack of the calling thread
+void __softboundcets_shadow_stack_destroy(void);
+
+// Set up the shadow stack (and stack lock space) of the calling thread, as far
+// as it does not exist yet, and release them when the thread exits
+void __softboundcets_thread_state_create(void);
+
+// The shadow stack of the calling thread. Threads that were not created by the
+// pthread_create wrapper (e.g., by std::thread, OpenMP, or other uninstrumented
+// code) set up their state on their first use of the shadow stack.
+shadow_stack_ptr_type __softboundcets_get_shadow_stack_ptr(void);
+
 void __softboundcets_allocate_shadow_stack_space(int num_pointer_args);
 
 void __softboundcets_deallocate_shadow_stack_space();
 
 __softboundcets_trie_entry_t *__softboundcets_trie_allocate();
 
+// The secondary table at the given index of the primary table, or NULL
+__softboundcets_trie_entry_t *
+__softboundcets_trie_secondary(size_t primary_index);
+
+// Install a new secondary table at the given index of the primary table, and
+// return it. If another thread installed one concurrently, the new table is
+// released and the one of the other thread is returned instead.
+__softboundcets_trie_entry_t *
+__softboundcets_trie_install_secondary(size_t primary_index);
+
 /* Metadata store parameterized by the mode of checking */
 
 #if __SOFTBOUNDCETS_SPATIAL
@@ -88,6 +88,23 @@ static_assert((__SOFTBOUNDCETS_SPATIAL ^ __SOFTBOUNDCETS_TEMPORAL ^
 #define __SOFTBOUNDCETS_PREALLOCATE_TRIE 0
 #endif
 
+// The metadata of pointers in memory is stored in a two-level trie indexed by
+// the (8 byte aligned) address of the pointer. Each secondary table holds the
+// entries of 2^__SOFTBOUNDCETS_TRIE_SECONDARY_BITS pointer locations, the
+// primary table the secondary tables for the remaining bits of a 48 bit
+// address. Smaller secondary tables reserve and touch less memory if pointers
+// are spread over the address space, but make the primary table larger (it has
+// 2^(45 - __SOFTBOUNDCETS_TRIE_SECONDARY_BITS) entries).
+// The instrumentation needs to use the same value, it is exported to
+// SBRTInfo.h.
+#ifndef __SOFTBOUNDCETS_TRIE_SECONDARY_BITS
+#define __SOFTBOUNDCETS_TRIE_SECONDARY_BITS 22
+#endif
+
+static_assert(__SOFTBOUNDCETS_TRIE_SECONDARY_BITS >= 12 &&
+                  __SOFTBOUNDCETS_TRIE_SECONDARY_BITS <= 30,
+              "__SOFTBOUNDCETS_TRIE_SECONDARY_BITS must be between 12 and 30");
+
 // TODO add description of this option
 // #define __SOFTBOUNDCETS_CONSTANT_STACK_KEY_LOCK
 
@@ -176,10 +193,15 @@ typedef struct {
 
 typedef size_t *shadow_stack_ptr_type;
 
+// Every thread has its own shadow stack. The one of the main thread is set up
+// in __softboundcets_init, the ones of other threads are created lazily by
+// __softboundcets_get_shadow_stack_ptr on their first use of it (the
+// pthread_create wrapper does this right when the thread starts).
+
 // The current level of the shadow stack
-extern shadow_stack_ptr_type __softboundcets_shadow_stack_ptr;
+extern _Thread_local shadow_stack_ptr_type __softboundcets_shadow_stack_ptr;
 
 // The limit of the shadow stack
-extern shadow_stack_ptr_type __softboundcets_shadow_stack_max;
+extern _Thread_local shadow_stack_ptr_type __softboundcets_shadow_stack_max;
 
 #endif // SOFTBOUNDCETS_DEFINES_H
@@ -1,5 +1,7 @@
 #include "softboundcets_spatial.h"
 
+#include "softboundcets_common.h"
+
 #include "fail_function.h"
 
 #include <assert.h>
@@ -81,7 +83,8 @@ __WEAK_INLINE void *__softboundcets_load_base_shadow_stack(int arg_no) {
     assert(arg_no >= 0);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BASE_INDEX;
-    shadow_stack_ptr_type base_ptr = __softboundcets_shadow_stack_ptr + count;
+    shadow_stack_ptr_type base_ptr =
+        __softboundcets_get_shadow_stack_ptr() + count;
     void *base = *((void **)base_ptr);
     __mi_debug_printf("Base loaded from shadow stack (location %i): %p\n",
                       arg_no, base);
@@ -93,7 +96,8 @@ __WEAK_INLINE void *__softboundcets_load_bound_shadow_stack(int arg_no) {
     assert(arg_no >= 0);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BOUND_INDEX;
-    shadow_stack_ptr_type bound_ptr = __softboundcets_shadow_stack_ptr + count;
+    shadow_stack_ptr_type bound_ptr =
+        __softboundcets_get_shadow_stack_ptr() + count;
     void *bound = *((void **)bound_ptr);
     __mi_debug_printf("Bound loaded from shadow stack (location %i): %p\n",
                       arg_no, bound);
@@ -108,7 +112,7 @@ __WEAK_INLINE void __softboundcets_store_base_shadow_stack(void *base,
                       arg_no, base);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BASE_INDEX;
-    void **base_ptr = (void **)(__softboundcets_shadow_stack_ptr + count);
+    void **base_ptr = (void **)(__softboundcets_get_shadow_stack_ptr() + count);
 
     *(base_ptr) = base;
 }
@@ -121,7 +125,8 @@ __WEAK_INLINE void __softboundcets_store_bound_shadow_stack(void *bound,
                       arg_no, bound);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BOUND_INDEX;
-    void **bound_ptr = (void **)(__softboundcets_shadow_stack_ptr + count);
+    void **bound_ptr =
+        (void **)(__softboundcets_get_shadow_stack_ptr() + count);
 
     *(bound_ptr) = bound;
 }
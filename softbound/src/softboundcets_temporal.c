@@ -5,6 +5,7 @@
 #include "fail_function.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 lock_type __softboundcets_global_lock = 0;
@@ -27,14 +28,43 @@ static const size_t __SOFTBOUNDCETS_N_GLOBAL_LOCK_SIZE =
 static const size_t __SOFTBOUNDCETS_N_FREE_MAP_ENTRIES =
     ((size_t)32 * (size_t)1024 * (size_t)1024);
 
+// Keys and heap lock locations are handed out to threads in blocks, such that
+// allocations only touch thread-local state in the common case
+static const size_t __SOFTBOUNDCETS_KEY_BLOCK_SIZE = ((size_t)1024 * 64);
+static const size_t __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES = (size_t)1024;
+
 size_t *__softboundcets_free_map_table = NULL;
 
-size_t *__softboundcets_lock_next_location = NULL;
+// The shared lock space, threads take chunks of it (atomically)
 size_t *__softboundcets_lock_new_location = NULL;
+// The next key block to hand out (atomically)
 size_t __softboundcets_key_id_counter = 2;
 
+// Locks of this thread that were released and can be reused
+_Thread_local size_t *__softboundcets_lock_next_location = NULL;
+// Released locks of exited threads, taken over (up to a chunk at a time) by
+// threads that run out of locks
+static void *__softboundcets_orphaned_locks = NULL;
+static pthread_mutex_t __softboundcets_orphaned_locks_mutex =
+    PTHREAD_MUTEX_INITIALIZER;
+// The remainder of the current lock chunk of this thread
+_Thread_local size_t *__softboundcets_thread_lock_new_location = NULL;
+_Thread_local size_t *__softboundcets_thread_lock_end = NULL;
+// The remainder of the current key block of this thread
+_Thread_local key_type __softboundcets_thread_key_next = 0;
+_Thread_local key_type __softboundcets_thread_key_end = 0;
+
 size_t *__softboundcets_temporal_space_begin = 0;
-size_t *__softboundcets_stack_temporal_space_begin = NULL;
+// Stack locks are allocated and released in LIFO order, so every thread has
+// its own stack lock space
+_Thread_local size_t *__softboundcets_stack_temporal_space_begin = NULL;
+_Thread_local size_t *__softboundcets_stack_temporal_space_base = NULL;
+// Stack lock spaces of exited threads, linked through their first entry. They
+// are never unmapped, as stale pointers to the stack objects of an exited
+// thread still refer to their locks.
+static size_t *__softboundcets_retired_stack_spaces = NULL;
+static pthread_mutex_t __softboundcets_retired_stack_spaces_mutex =
+    PTHREAD_MUTEX_INITIALIZER;
 
 //===------------------- Data structure initialization --------------------===//
 
@@ -51,12 +81,9 @@ __WEAK_INLINE void __softboundcets_temporal_initialize_datastructures(void) {
     __softboundcets_temporal_space_begin =
         (size_t *)__softboundcets_lock_new_location;
 
-    size_t stack_temporal_table_length =
-        (__SOFTBOUNDCETS_N_STACK_TEMPORAL_ENTRIES) * sizeof(void *);
-    __softboundcets_stack_temporal_space_begin =
-        mmap(0, stack_temporal_table_length, PROT_READ | PROT_WRITE,
-             SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
-    assert(__softboundcets_stack_temporal_space_begin != (void *)-1);
+    // The stack lock space of the main thread, other threads get theirs in the
+    // pthread_create wrapper or on their first stack allocation
+    __softboundcets_stack_temporal_space_create();
 
     size_t global_lock_size =
         (__SOFTBOUNDCETS_N_GLOBAL_LOCK_SIZE) * sizeof(void *);
@@ -77,6 +104,84 @@ __WEAK_INLINE void __softboundcets_temporal_initialize_datastructures(void) {
 #endif
 }
 
+// Take over the stack lock space of an exited thread. Returns NULL if there is
+// none.
+static size_t *__softboundcets_reuse_stack_temporal_space(void) {
+    if (__atomic_load_n(&__softboundcets_retired_stack_spaces,
+                        __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&__softboundcets_retired_stack_spaces_mutex);
+    size_t *space = __softboundcets_retired_stack_spaces;
+    if (space != NULL) {
+        __softboundcets_retired_stack_spaces = *(size_t **)space;
+        *space = 0;
+    }
+    pthread_mutex_unlock(&__softboundcets_retired_stack_spaces_mutex);
+    return space;
+}
+
+void __softboundcets_stack_temporal_space_create(void) {
+    size_t *space = __softboundcets_reuse_stack_temporal_space();
+    if (space == NULL) {
+        size_t stack_temporal_table_length =
+            (__SOFTBOUNDCETS_N_STACK_TEMPORAL_ENTRIES) * sizeof(void *);
+        space = mmap(0, stack_temporal_table_length, PROT_READ | PROT_WRITE,
+                     SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+        assert(space != (void *)-1);
+    }
+    __softboundcets_stack_temporal_space_base = space;
+    __softboundcets_stack_temporal_space_begin = space;
+}
+
+void __softboundcets_release_thread_locks(void) {
+    // Hand back the unused remainder of the current chunk as well, otherwise
+    // short-lived threads use up the lock space
+    while (__softboundcets_thread_lock_new_location <
+           __softboundcets_thread_lock_end) {
+        size_t *lock = --__softboundcets_thread_lock_end;
+        *(void **)lock = __softboundcets_lock_next_location;
+        __softboundcets_lock_next_location = lock;
+    }
+    __softboundcets_thread_lock_new_location = NULL;
+    __softboundcets_thread_lock_end = NULL;
+
+    void *first = __softboundcets_lock_next_location;
+    if (first == NULL) {
+        return;
+    }
+    void *last = first;
+    while (*(void **)last != NULL) {
+        last = *(void **)last;
+    }
+
+    pthread_mutex_lock(&__softboundcets_orphaned_locks_mutex);
+    *(void **)last = __softboundcets_orphaned_locks;
+    __softboundcets_orphaned_locks = first;
+    pthread_mutex_unlock(&__softboundcets_orphaned_locks_mutex);
+    __softboundcets_lock_next_location = NULL;
+}
+
+void __softboundcets_stack_temporal_space_destroy(void) {
+    size_t *space = __softboundcets_stack_temporal_space_base;
+    if (space == NULL) {
+        return;
+    }
+    // Locks of frames that were never left (e.g., on pthread_exit) still hold
+    // their keys, invalidate them before the space is reused
+    for (size_t *lock = space;
+         lock < __softboundcets_stack_temporal_space_begin; lock++) {
+        *lock = 0;
+    }
+
+    pthread_mutex_lock(&__softboundcets_retired_stack_spaces_mutex);
+    *(size_t **)space = __softboundcets_retired_stack_spaces;
+    __softboundcets_retired_stack_spaces = space;
+    pthread_mutex_unlock(&__softboundcets_retired_stack_spaces_mutex);
+    __softboundcets_stack_temporal_space_base = NULL;
+    __softboundcets_stack_temporal_space_begin = NULL;
+}
+
 //===----------------------------- Checks ---------------------------------===//
 
 __WEAK_INLINE void
@@ -107,7 +212,7 @@ __WEAK_INLINE key_type __softboundcets_load_key_shadow_stack(int arg_no) {
     assert(arg_no >= 0);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __KEY_INDEX;
-    key_type *key_ptr = __softboundcets_shadow_stack_ptr + count;
+    key_type *key_ptr = __softboundcets_get_shadow_stack_ptr() + count;
     key_type key = *key_ptr;
     return key;
 }
@@ -117,7 +222,8 @@ __WEAK_INLINE lock_type __softboundcets_load_lock_shadow_stack(int arg_no) {
     assert(arg_no >= 0);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __LOCK_INDEX;
-    shadow_stack_ptr_type lock_ptr = __softboundcets_shadow_stack_ptr + count;
+    shadow_stack_ptr_type lock_ptr =
+        __softboundcets_get_shadow_stack_ptr() + count;
     lock_type lock = *((lock_type *)lock_ptr);
     return lock;
 }
@@ -128,7 +234,7 @@ __WEAK_INLINE void __softboundcets_store_key_shadow_stack(key_type key,
     assert(arg_no >= 0);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __KEY_INDEX;
-    key_type *key_ptr = (__softboundcets_shadow_stack_ptr + count);
+    key_type *key_ptr = (__softboundcets_get_shadow_stack_ptr() + count);
 
     *(key_ptr) = key;
 }
@@ -139,7 +245,8 @@ __WEAK_INLINE void __softboundcets_store_lock_shadow_stack(lock_type lock,
     assert(arg_no >= 0);
     size_t count =
         2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __LOCK_INDEX;
-    lock_type *lock_ptr = (void **)(__softboundcets_shadow_stack_ptr + count);
+    lock_type *lock_ptr =
+        (void **)(__softboundcets_get_shadow_stack_ptr() + count);
 
     *(lock_ptr) = lock;
 }
@@ -176,25 +283,62 @@ __WEAK_INLINE void __softboundcets_memory_deallocation(lock_type ptr_lock,
     __softboundcets_lock_next_location = ptr_lock;
 }
 
-__WEAK_INLINE void *__softboundcets_allocate_lock_location() {
+// Take a new chunk of lock locations from the shared lock space
+static void __softboundcets_refill_lock_chunk(void) {
+    size_t *chunk = __atomic_fetch_add(
+        &__softboundcets_lock_new_location,
+        __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES * sizeof(size_t), __ATOMIC_RELAXED);
 
-    void *temp = NULL;
-    if (__softboundcets_lock_next_location == NULL) {
+    __mi_debug_printf("[lock_allocate] new lock chunk=%p\n", chunk);
 
-#ifdef MIRT_DEBUG
-        // TODO not sure if all of this is only to be done when debugging
-        __mi_debug_printf("[lock_allocate] new_lock_location=%p\n",
-                          __softboundcets_lock_new_location);
+    if (chunk + __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES >
+        __softboundcets_temporal_space_begin +
+            __SOFTBOUNDCETS_N_TEMPORAL_ENTRIES) {
+        __mi_fail_with_msg("[lock_allocate] out of temporal free entries \n");
+    }
+
+    __softboundcets_thread_lock_new_location = chunk;
+    __softboundcets_thread_lock_end =
+        chunk + __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES;
+}
 
-        if (__softboundcets_lock_new_location >
-            __softboundcets_temporal_space_begin +
-                __SOFTBOUNDCETS_N_TEMPORAL_ENTRIES) {
-            __mi_fail_with_msg(
-                "[lock_allocate] out of temporal free entries \n");
+// Take over up to a chunk of the released locks of exited threads, such that
+// threads running out of locks at the same time share them. Returns 0 if there
+// are none.
+static int __softboundcets_adopt_orphaned_locks(void) {
+    if (__atomic_load_n(&__softboundcets_orphaned_locks, __ATOMIC_RELAXED) ==
+        NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&__softboundcets_orphaned_locks_mutex);
+    void *first = __softboundcets_orphaned_locks;
+    if (first != NULL) {
+        void *last = first;
+        for (size_t n = 1;
+             n < __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES && *(void **)last != NULL;
+             n++) {
+            last = *(void **)last;
         }
-#endif
+        __softboundcets_orphaned_locks = *(void **)last;
+        *(void **)last = NULL;
+    }
+    pthread_mutex_unlock(&__softboundcets_orphaned_locks_mutex);
+    __softboundcets_lock_next_location = first;
+    return first != NULL;
+}
 
-        return __softboundcets_lock_new_location++;
+__WEAK_INLINE void *__softboundcets_allocate_lock_location() {
+
+    void *temp = NULL;
+    if (__softboundcets_lock_next_location == NULL &&
+        __softboundcets_thread_lock_new_location ==
+            __softboundcets_thread_lock_end &&
+        !__softboundcets_adopt_orphaned_locks()) {
+        __softboundcets_refill_lock_chunk();
+    }
+
+    if (__softboundcets_lock_next_location == NULL) {
+        return __softboundcets_thread_lock_new_location++;
     } else {
 
         temp = __softboundcets_lock_next_location;
@@ -207,6 +351,18 @@ __WEAK_INLINE void *__softboundcets_allocate_lock_location() {
     }
 }
 
+__WEAK_INLINE key_type __softboundcets_next_key(void) {
+
+    if (__softboundcets_thread_key_next == __softboundcets_thread_key_end) {
+        __softboundcets_thread_key_next = __atomic_fetch_add(
+            &__softboundcets_key_id_counter, __SOFTBOUNDCETS_KEY_BLOCK_SIZE,
+            __ATOMIC_RELAXED);
+        __softboundcets_thread_key_end =
+            __softboundcets_thread_key_next + __SOFTBOUNDCETS_KEY_BLOCK_SIZE;
+    }
+    return __softboundcets_thread_key_next++;
+}
+
 __WEAK_INLINE void __softboundcets_stack_memory_allocation(lock_type *ptr_lock,
                                                            key_type *ptr_key) {
 
@@ -214,7 +370,13 @@ __WEAK_INLINE void __softboundcets_stack_memory_allocation(lock_type *ptr_lock,
     *ptr_key = 1;
     *((size_t **)ptr_lock) = __softboundcets_get_global_lock();
 #else
-    key_type temp_id = __softboundcets_key_id_counter++;
+    // Threads that were not created by the pthread_create wrapper get their
+    // stack lock space on their first stack allocation
+    if (__builtin_expect(__softboundcets_stack_temporal_space_begin == NULL,
+                         0)) {
+        __softboundcets_thread_state_create();
+    }
+    key_type temp_id = __softboundcets_next_key();
     *((size_t **)ptr_lock) =
         (size_t *)__softboundcets_stack_temporal_space_begin++;
     *ptr_key = temp_id;
@@ -226,7 +388,7 @@ __WEAK_INLINE void __softboundcets_memory_allocation(void *ptr,
                                                      lock_type *ptr_lock,
                                                      key_type *ptr_key) {
 
-    key_type temp_id = __softboundcets_key_id_counter++;
+    key_type temp_id = __softboundcets_next_key();
 
     *((key_type **)ptr_lock) =
         (key_type *)__softboundcets_allocate_lock_location();
@@ -19,6 +19,16 @@ lock_type __softboundcets_get_global_lock();
 
 void __softboundcets_temporal_initialize_datastructures(void);
 
+// Set up the stack lock space of the current thread (reusing the one of an
+// exited thread if possible), and retire it when the thread exits
+void __softboundcets_stack_temporal_space_create(void);
+
+void __softboundcets_stack_temporal_space_destroy(void);
+
+// Hand the released locks (and the rest of the lock chunk) of the exiting
+// thread over to the other threads
+void __softboundcets_release_thread_locks(void);
+
 //===----------------------------- Check ----------------------------------===//
 
 void __softboundcets_temporal_dereference_check(lock_type pointer_lock,
@@ -42,6 +52,8 @@ void __softboundcets_memory_deallocation(lock_type ptr_lock, key_type ptr_key);
 
 void *__softboundcets_allocate_lock_location();
 
+key_type __softboundcets_next_key(void);
+
 void __softboundcets_stack_memory_allocation(lock_type *ptr_lock,
                                              key_type *ptr_key);
 
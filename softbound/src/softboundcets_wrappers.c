@@ -45,6 +45,7 @@
 #include <malloc.h>
 #include <math.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <setjmp.h>
 #include <signal.h>
@@ -1732,6 +1733,82 @@ __WEAK_INLINE sighandler_t softboundcets_signal(int signum,
     return ptr;
 }
 
+//===----------------------------------------------------------------------===//
+//                            pthread.h Wrappers
+//===----------------------------------------------------------------------===//
+
+// The start routine of a thread, and the argument it is called with together
+// with its metadata
+typedef struct {
+    void *(*start_routine)(void *);
+    void *arg;
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    void *arg_base;
+    void *arg_bound;
+#endif
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    key_type arg_key;
+    lock_type arg_lock;
+#endif
+} thread_start_info_t;
+
+// Threads start here, they set up their own shadow stack (and stack lock
+// space) and hand over the metadata of the argument to the (instrumented) start
+// routine
+static void *thread_start_helper(void *data) {
+    thread_start_info_t start = *(thread_start_info_t *)data;
+    free(data);
+
+    __softboundcets_thread_state_create();
+
+    // Slot 0 holds the metadata of the returned pointer, slot 1 the one of the
+    // argument
+    __softboundcets_allocate_shadow_stack_space(2);
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_base_shadow_stack(start.arg_base, 1);
+    __softboundcets_store_bound_shadow_stack(start.arg_bound, 1);
+#endif
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_key_shadow_stack(start.arg_key, 1);
+    __softboundcets_store_lock_shadow_stack(start.arg_lock, 1);
+#endif
+
+    void *ret = start.start_routine(start.arg);
+
+    __softboundcets_deallocate_shadow_stack_space();
+    return ret;
+}
+
+__WEAK_INLINE int softboundcets_pthread_create(pthread_t *thread,
+                                               const pthread_attr_t *attr,
+                                               void *(*start_routine)(void *),
+                                               void *arg) {
+
+    __softboundcets_wrapper_check_shadow_stack_ptr(0, (char *)thread,
+                                                   sizeof(pthread_t));
+
+    thread_start_info_t *start = malloc(sizeof(*start));
+    if (start == NULL) {
+        return EAGAIN;
+    }
+    start->start_routine = start_routine;
+    start->arg = arg;
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    start->arg_base = __softboundcets_load_base_shadow_stack(3);
+    start->arg_bound = __softboundcets_load_bound_shadow_stack(3);
+#endif
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    start->arg_key = __softboundcets_load_key_shadow_stack(3);
+    start->arg_lock = __softboundcets_load_lock_shadow_stack(3);
+#endif
+
+    int ret = pthread_create(thread, attr, thread_start_helper, start);
+    if (ret != 0) {
+        free(start);
+    }
+    return ret;
+}
+
 //===----------------------------------------------------------------------===//
 //                    Memory Management Function Wrapper
 //===----------------------------------------------------------------------===//
@@ -2229,12 +2306,16 @@ __WEAK_INLINE int *softboundcets___errno_location() {
 //                            qsort...
 //===----------------------------------------------------------------------===//
 
-/* This is a custom implementation of qsort */
-static int
-compare_elements_helper(void *base, size_t element_size, int idx1, int idx2,
-                        int (*comparer)(const void *, const void *)) {
+// qsort sorts a permutation of the element indices with a merge sort, and then
+// moves the elements and their metadata to their final position at once. If
+// the memory for this is not available, it falls back to an in-place heap sort.
+
+// Call the comparator for two elements of the array. The pointer arguments of
+// the comparator get the metadata of the array.
+static int compare_elements_helper(const char *elem1, const char *elem2,
+                                   int (*comparer)(const void *,
+                                                   const void *)) {
 
-    char *base_bytes = base;
     // Make sure the bounds for the pointer arguments of the comparator are
     // stored on the shadow stack
 
@@ -2265,102 +2346,262 @@ compare_elements_helper(void *base, size_t element_size, int idx1, int idx2,
     __softboundcets_store_key_shadow_stack(ptr_key, 1);
 #endif
 
-    int res = comparer(&base_bytes[idx1 * element_size],
-                       &base_bytes[idx2 * element_size]);
+    int res = comparer(elem1, elem2);
 
     __softboundcets_deallocate_shadow_stack_space();
 
     return res;
 }
 
-#define element_less_than(i, j)                                                \
-    (compare_elements_helper(base, element_size, (i), (j), comparer) < 0)
+// Load/store the metadata of the pointer stored at addr from/to entry
+static void load_slot_metadata(const void *addr,
+                               __softboundcets_trie_entry_t *entry) {
+#if __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_load(addr, &entry->base, &entry->bound);
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_load(addr, &entry->key, &entry->lock);
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_metadata_load(addr, &entry->base, &entry->bound,
+                                  &entry->key, &entry->lock);
+#endif
+}
+
+static void store_slot_metadata(const void *addr,
+                                const __softboundcets_trie_entry_t *entry) {
+#if __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_store(addr, entry->base, entry->bound);
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_store(addr, entry->key, entry->lock);
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_metadata_store(addr, entry->base, entry->bound, entry->key,
+                                   entry->lock);
+#endif
+}
+
+static int is_empty_metadata(const __softboundcets_trie_entry_t *entry) {
+    static const __softboundcets_trie_entry_t empty;
+    return memcmp(entry, &empty, sizeof(empty)) == 0;
+}
 
-static void exchange_elements_helper(void *base, size_t element_size, int idx1,
-                                     int idx2) {
+// Elements can only hold pointers (and therefore metadata) if they are 8 byte
+// aligned
+static int elements_have_metadata_slots(const void *base,
+                                        size_t element_size) {
+    return element_size % 8 == 0 && (uintptr_t)base % 8 == 0;
+}
 
-    char *base_bytes = base;
-    size_t i;
+// Swap two elements together with the metadata of the pointers in them
+static void exchange_elements_helper(char *elem1, char *elem2,
+                                     size_t element_size, int with_metadata) {
 
-    for (i = 0; i < element_size; i++) {
-        char temp = base_bytes[idx1 * element_size + i];
-        base_bytes[idx1 * element_size + i] =
-            base_bytes[idx2 * element_size + i];
-        base_bytes[idx2 * element_size + i] = temp;
+    size_t i = 0;
+    for (; i + sizeof(size_t) <= element_size; i += sizeof(size_t)) {
+        size_t temp;
+        memcpy(&temp, elem1 + i, sizeof(size_t));
+        memcpy(elem1 + i, elem2 + i, sizeof(size_t));
+        memcpy(elem2 + i, &temp, sizeof(size_t));
+    }
+    for (; i < element_size; i++) {
+        char temp = elem1[i];
+        elem1[i] = elem2[i];
+        elem2[i] = temp;
+    }
+
+    if (!with_metadata) {
+        return;
     }
 
     for (i = 0; i < element_size; i += 8) {
+        __softboundcets_trie_entry_t entry1, entry2;
+        load_slot_metadata(elem1 + i, &entry1);
+        load_slot_metadata(elem2 + i, &entry2);
+        if (is_empty_metadata(&entry1) && is_empty_metadata(&entry2)) {
+            continue;
+        }
+        store_slot_metadata(elem1 + i, &entry2);
+        store_slot_metadata(elem2 + i, &entry1);
+    }
+}
 
-#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
-        void *base_idx1;
-        void *bound_idx1;
+static void sift_down(char *base, size_t element_size, size_t root, size_t end,
+                      int with_metadata,
+                      int (*comparer)(const void *, const void *)) {
 
-        void *base_idx2;
-        void *bound_idx2;
-#endif
+    while (2 * root + 1 < end) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < end &&
+            compare_elements_helper(base + child * element_size,
+                                    base + (child + 1) * element_size,
+                                    comparer) < 0) {
+            child++;
+        }
+        if (compare_elements_helper(base + root * element_size,
+                                    base + child * element_size,
+                                    comparer) >= 0) {
+            return;
+        }
+        exchange_elements_helper(base + root * element_size,
+                                 base + child * element_size, element_size,
+                                 with_metadata);
+        root = child;
+    }
+}
 
-#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
-        key_type key_idx1 = 1;
-        key_type key_idx2 = 1;
+// In-place fallback in case there is no memory for the permutation
+static void heap_sort(char *base, size_t num_elements, size_t element_size,
+                      int (*comparer)(const void *, const void *)) {
 
-        lock_type lock_idx1 = NULL;
-        lock_type lock_idx2 = NULL;
-#endif
+    int with_metadata = elements_have_metadata_slots(base, element_size);
 
-        char *addr_idx1 = &base_bytes[idx1 * element_size + i];
-        char *addr_idx2 = &base_bytes[idx2 * element_size + i];
+    for (size_t i = num_elements / 2; i > 0; i--) {
+        sift_down(base, element_size, i - 1, num_elements, with_metadata,
+                  comparer);
+    }
+    for (size_t end = num_elements - 1; end > 0; end--) {
+        exchange_elements_helper(base, base + end * element_size, element_size,
+                                 with_metadata);
+        sift_down(base, element_size, 0, end, with_metadata, comparer);
+    }
+}
 
-#if __SOFTBOUNDCETS_SPATIAL
-        __softboundcets_metadata_load(addr_idx1, &base_idx1, &bound_idx1);
-        __softboundcets_metadata_load(addr_idx2, &base_idx2, &bound_idx2);
+// Runs of this many indices are sorted by insertion before merging
+#define MIN_QSORT_MERGE_SIZE 16
 
-        __softboundcets_metadata_store(addr_idx1, base_idx2, bound_idx2);
-        __softboundcets_metadata_store(addr_idx2, base_idx1, bound_idx1);
+// Sort the indices of the elements into perm, buffer needs to have the same
+// size. Returns the one of both that holds the result.
+static size_t *sort_permutation(const char *base, size_t num_elements,
+                                size_t element_size, size_t *perm,
+                                size_t *buffer,
+                                int (*comparer)(const void *, const void *)) {
 
-#elif __SOFTBOUNDCETS_TEMPORAL
+    for (size_t i = 0; i < num_elements; i++) {
+        perm[i] = i;
+    }
 
-        __softboundcets_metadata_load(addr_idx1, &key_idx1, &lock_idx1);
-        __softboundcets_metadata_load(addr_idx2, &key_idx2, &lock_idx2);
+    for (size_t run = 0; run < num_elements; run += MIN_QSORT_MERGE_SIZE) {
+        size_t run_end = run + MIN_QSORT_MERGE_SIZE < num_elements
+                             ? run + MIN_QSORT_MERGE_SIZE
+                             : num_elements;
+        for (size_t i = run + 1; i < run_end; i++) {
+            size_t index = perm[i];
+            size_t j = i;
+            while (j > run &&
+                   compare_elements_helper(base + index * element_size,
+                                           base + perm[j - 1] * element_size,
+                                           comparer) < 0) {
+                perm[j] = perm[j - 1];
+                j--;
+            }
+            perm[j] = index;
+        }
+    }
 
-        __softboundcets_metadata_store(addr_idx1, key_idx2, lock_idx2);
-        __softboundcets_metadata_store(addr_idx2, key_idx1, lock_idx1);
+    for (size_t width = MIN_QSORT_MERGE_SIZE; width < num_elements;
+         width *= 2) {
+        for (size_t left = 0; left < num_elements; left += 2 * width) {
+            size_t mid = left + width < num_elements ? left + width
+                                                      : num_elements;
+            size_t right =
+                mid + width < num_elements ? mid + width : num_elements;
+            size_t i = left, j = mid, k = left;
+            while (i < mid && j < right) {
+                // Take from the right run only if it is smaller, such that
+                // equal elements keep their order
+                if (compare_elements_helper(base + perm[j] * element_size,
+                                            base + perm[i] * element_size,
+                                            comparer) < 0) {
+                    buffer[k++] = perm[j++];
+                } else {
+                    buffer[k++] = perm[i++];
+                }
+            }
+            while (i < mid) {
+                buffer[k++] = perm[i++];
+            }
+            while (j < right) {
+                buffer[k++] = perm[j++];
+            }
+        }
+        size_t *temp = perm;
+        perm = buffer;
+        buffer = temp;
+    }
+    return perm;
+}
 
-#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+// Move the elements (and the metadata of the pointers in them) such that the
+// element at index perm[k] ends up at index k
+static int apply_permutation(char *base, size_t num_elements,
+                             size_t element_size, const size_t *perm) {
 
-        __softboundcets_metadata_load(addr_idx1, &base_idx1, &bound_idx1,
-                                      &key_idx1, &lock_idx1);
-        __softboundcets_metadata_load(addr_idx2, &base_idx2, &bound_idx2,
-                                      &key_idx2, &lock_idx2);
+    size_t slots = element_size / 8;
+    int with_metadata = elements_have_metadata_slots(base, element_size);
 
-        __softboundcets_metadata_store(addr_idx1, base_idx2, bound_idx2,
-                                       key_idx2, lock_idx2);
-        __softboundcets_metadata_store(addr_idx2, base_idx1, bound_idx1,
-                                       key_idx1, lock_idx1);
+    char *elements = malloc(num_elements * element_size);
+    __softboundcets_trie_entry_t *entries =
+        with_metadata ? malloc(num_elements * slots * sizeof(*entries)) : NULL;
+    if (elements == NULL || (with_metadata && entries == NULL)) {
+        free(elements);
+        free(entries);
+        return 0;
+    }
 
-#endif
+    // Only write back metadata if there is any, otherwise storing the empty
+    // entries would allocate trie tables for arrays without pointers
+    int found_metadata = 0;
+    if (with_metadata) {
+        for (size_t i = 0; i < num_elements * slots; i++) {
+            load_slot_metadata(base + i * 8, &entries[i]);
+            found_metadata |= !is_empty_metadata(&entries[i]);
+        }
     }
-}
 
-#define exchange_elements(i, j)                                                \
-    (exchange_elements_helper(base, element_size, (i), (j)))
+    for (size_t k = 0; k < num_elements; k++) {
+        memcpy(elements + k * element_size, base + perm[k] * element_size,
+               element_size);
+    }
+    memcpy(base, elements, num_elements * element_size);
+
+    if (found_metadata) {
+        for (size_t k = 0; k < num_elements; k++) {
+            for (size_t s = 0; s < slots; s++) {
+                store_slot_metadata(base + k * element_size + s * 8,
+                                    &entries[perm[k] * slots + s]);
+            }
+        }
+    }
 
-#define MIN_QSORT_LIST_SIZE 32
+    free(elements);
+    free(entries);
+    return 1;
+}
 
 __WEAK__
 void my_qsort(void *base, size_t num_elements, size_t element_size,
               int (*comparer)(const void *, const void *)) {
 
-    size_t i;
+    if (num_elements < 2 || element_size == 0) {
+        return;
+    }
 
-    for (i = 0; i < num_elements; i++) {
-        int j;
-        for (j = i - 1; j >= 0; j--) {
-            if (element_less_than(j, j + 1))
-                break;
-            exchange_elements(j, j + 1);
+    size_t *perm = malloc(num_elements * sizeof(size_t));
+    size_t *buffer = malloc(num_elements * sizeof(size_t));
+    if (perm != NULL && buffer != NULL) {
+        size_t *sorted = sort_permutation(base, num_elements, element_size,
+                                          perm, buffer, comparer);
+        int applied =
+            apply_permutation(base, num_elements, element_size, sorted);
+        free(perm);
+        free(buffer);
+        if (applied) {
+            return;
         }
+    } else {
+        free(perm);
+        free(buffer);
     }
-    /* may be implement qsort here */
+
+    heap_sort(base, num_elements, element_size, comparer);
 }
 
 __WEAK_INLINE void softboundcets_qsort(void *base, size_t nmemb, size_t size,
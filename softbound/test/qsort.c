@@ -0,0 +1,267 @@
+// Regression test for the qsort wrapper, which sorts a permutation of the
+// element indices and then moves the elements and the metadata of the pointers
+// in them, or falls back to an in-place heap sort without memory for this.
+//
+// It checks that
+//  - arrays of structs with pointers are sorted, and the metadata of every
+//    8 byte slot moves with its element (slots without pointers get none),
+//  - the heap sort fallback does the same if the allocations fail,
+//  - elements whose size is not a multiple of 8 are sorted correctly.
+
+#include "softboundcets_common.h"
+#include "softboundcets_spatial.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Usually called by the instrumentation
+void __softboundcets_init(void);
+
+void softboundcets_qsort(void *base, size_t nmemb, size_t size,
+                         int (*compar)(const void *, const void *));
+
+__attribute__((constructor)) static void init_runtime(void) {
+    __softboundcets_init();
+}
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Store metadata derived from value for the pointer at addr, load returns the
+// value again (or 0 if there is no metadata)
+static void store(const void *addr, size_t value) {
+#if __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_store(addr, (void *)value, (void *)(value + 1));
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_store(addr, value, (lock_type)value);
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_metadata_store(addr, (void *)value, (void *)(value + 1),
+                                   value, (lock_type)value);
+#endif
+}
+
+static size_t load(const void *addr) {
+#if __SOFTBOUNDCETS_SPATIAL
+    void *base, *bound;
+    __softboundcets_metadata_load(addr, &base, &bound);
+    return (size_t)base;
+#elif __SOFTBOUNDCETS_TEMPORAL
+    key_type key;
+    lock_type lock;
+    __softboundcets_metadata_load(addr, &key, &lock);
+    return key;
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    void *base, *bound;
+    key_type key;
+    lock_type lock;
+    __softboundcets_metadata_load(addr, &base, &bound, &key, &lock);
+    return key;
+#endif
+}
+
+// Call the wrapper the way instrumented code does, with the metadata of the
+// array on the shadow stack
+static void sort(void *base, size_t num_elements, size_t element_size,
+                 int (*comparer)(const void *, const void *)) {
+    __softboundcets_allocate_shadow_stack_space(5);
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_base_shadow_stack(base, 1);
+    __softboundcets_store_bound_shadow_stack(
+        (char *)base + num_elements * element_size, 1);
+#endif
+    softboundcets_qsort(base, num_elements, element_size, comparer);
+    __softboundcets_deallocate_shadow_stack_space();
+}
+
+typedef struct {
+    long key;
+    char *ptr;
+    size_t index;
+} item;
+
+static int compare_items(const void *a, const void *b) {
+    long x = ((const item *)a)->key, y = ((const item *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static char *targets;
+
+// Fill the items with keys that have duplicates, every item points to its own
+// target and has metadata for it
+static item *create_items(size_t num_items) {
+    item *items = malloc(num_items * sizeof(item));
+    for (size_t i = 0; i < num_items; i++) {
+        items[i].key = next_random() % (num_items / 2 + 1);
+        items[i].ptr = &targets[i];
+        items[i].index = i;
+        store(&items[i].ptr, (size_t)items[i].ptr);
+    }
+    return items;
+}
+
+static int check_items(const item *items, size_t num_items, const char *name) {
+    for (size_t i = 0; i < num_items; i++) {
+        if (i > 0 && items[i - 1].key > items[i].key) {
+            printf("%s: items %zu and %zu are not sorted\n", name, i - 1, i);
+            return 1;
+        }
+        if (items[i].ptr != &targets[items[i].index]) {
+            printf("%s: item %zu was not moved as a whole\n", name, i);
+            return 1;
+        }
+        if (load(&items[i].ptr) != (size_t)items[i].ptr) {
+            printf("%s: pointer of item %zu has the wrong metadata\n", name,
+                   i);
+            return 1;
+        }
+        if (load(&items[i].key) != 0 || load(&items[i].index) != 0) {
+            printf("%s: item %zu has metadata without a pointer\n", name, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Test: Structs with pointers are sorted together with their metadata
+static int test_pointer_structs(void) {
+    // Also sizes around the runs that are sorted by insertion
+    size_t sizes[] = {2, 15, 16, 17, 33, 1000, 100000};
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        item *items = create_items(sizes[s]);
+        sort(items, sizes[s], sizeof(item), compare_items);
+        if (check_items(items, sizes[s], "merge sort")) {
+            return 1;
+        }
+        free(items);
+    }
+    return 0;
+}
+
+static size_t mapped_bytes(void) {
+    size_t pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%zu", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Test: Without memory for the permutation, the heap sort fallback sorts the
+// structs together with their metadata
+static int test_heap_sort_fallback(void) {
+    // The permutation does not fit into the free space of the heap
+    size_t num_items = 100000;
+    item *items = create_items(num_items);
+    size_t permutation_size = num_items * sizeof(size_t);
+
+    // Keep the address space at what is mapped now, such that no memory can
+    // be allocated during the sort
+    struct rlimit old_limit, limit;
+    getrlimit(RLIMIT_AS, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = mapped_bytes();
+    if (limit.rlim_cur == 0 || setrlimit(RLIMIT_AS, &limit) != 0) {
+        printf("heap sort: could not limit the address space\n");
+        return 1;
+    }
+    void *probe = malloc(permutation_size);
+    if (probe == NULL) {
+        sort(items, num_items, sizeof(item), compare_items);
+    }
+    setrlimit(RLIMIT_AS, &old_limit);
+
+    if (probe != NULL) {
+        printf("heap sort: the permutation could still be allocated\n");
+        return 1;
+    }
+    if (check_items(items, num_items, "heap sort")) {
+        return 1;
+    }
+    free(items);
+    return 0;
+}
+
+typedef struct {
+    unsigned char bytes[3];
+} triple;
+
+static int compare_triples(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(triple));
+}
+
+typedef struct {
+    int key;
+    int index;
+    int check;
+} triplet;
+
+static int compare_triplets(const void *a, const void *b) {
+    int x = ((const triplet *)a)->key, y = ((const triplet *)b)->key;
+    return (x > y) - (x < y);
+}
+
+// Test: Elements whose size is not a multiple of 8 are sorted and moved as a
+// whole
+static int test_odd_sizes(void) {
+    for (size_t num = 0; num < 40; num++) {
+        triple triples[40];
+        for (size_t i = 0; i < num; i++) {
+            for (int k = 0; k < 3; k++) {
+                triples[i].bytes[k] = next_random() % 4;
+            }
+        }
+        sort(triples, num, sizeof(triple), compare_triples);
+        for (size_t i = 1; i < num; i++) {
+            if (compare_triples(&triples[i - 1], &triples[i]) > 0) {
+                printf("size 3: %zu elements are not sorted\n", num);
+                return 1;
+            }
+        }
+    }
+
+    size_t num_triplets = 1000;
+    triplet *triplets = malloc(num_triplets * sizeof(triplet));
+    for (size_t i = 0; i < num_triplets; i++) {
+        triplets[i].key = next_random() % 100;
+        triplets[i].index = i;
+        triplets[i].check = ~triplets[i].key ^ (int)i;
+    }
+    sort(triplets, num_triplets, sizeof(triplet), compare_triplets);
+    for (size_t i = 0; i < num_triplets; i++) {
+        if ((i > 0 && triplets[i - 1].key > triplets[i].key) ||
+            triplets[i].check != (~triplets[i].key ^ triplets[i].index)) {
+            printf("size 12: element %zu is not sorted or was torn\n", i);
+            return 1;
+        }
+    }
+    free(triplets);
+    return 0;
+}
+
+int softboundcets_pseudo_main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    targets = malloc(100000);
+    if (test_pointer_structs() || test_heap_sort_fallback() ||
+        test_odd_sizes()) {
+        return 1;
+    }
+    free(targets);
+
+    printf("qsort tests passed\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Regression test for the temporal state that threads hand over when they
+// exit, built with temporal safety only and with both.
+//
+// More threads than there are lock chunks in the lock space run, a few at a
+// time. Each of them allocates a heap lock and a stack lock, and exits without
+// releasing them (like on pthread_exit). It checks that
+//  - the unused rest of the lock chunk of an exited thread is handed over to
+//    later threads, such that the lock space is not used up,
+//  - heap locks of exited threads stay valid and are not handed out again,
+//  - stack locks of exited threads stay mapped and are invalidated,
+//  - the stack lock spaces of exited threads are reused.
+
+#include "softboundcets_common.h"
+#include "softboundcets_temporal.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Usually called by the instrumentation
+void __softboundcets_init(void);
+
+__attribute__((constructor)) static void init_runtime(void) {
+    __softboundcets_init();
+}
+
+// The lock space holds 64Mi locks, i.e., 64Ki chunks of 1024
+#define NUM_THREADS (70 * 1024)
+#define THREADS_AT_ONCE 4
+
+typedef struct {
+    lock_type heap_lock;
+    key_type heap_key;
+    lock_type stack_lock;
+    key_type stack_key;
+} worker;
+
+static worker workers[NUM_THREADS];
+
+static pthread_barrier_t exit_barrier;
+
+static void *run_worker(void *arg) {
+    worker *self = arg;
+    // The first stack allocation sets up the temporal state of the thread. The
+    // first lock of a retired space links it to the others, so the test checks
+    // the second one.
+    lock_type frame_lock;
+    key_type frame_key;
+    __softboundcets_stack_memory_allocation(&frame_lock, &frame_key);
+    __softboundcets_stack_memory_allocation(&self->stack_lock,
+                                            &self->stack_key);
+    __softboundcets_memory_allocation(self, &self->heap_lock,
+                                      &self->heap_key);
+    // Otherwise, another thread of the same batch could already reuse the
+    // stack lock space of this one
+    pthread_barrier_wait(&exit_barrier);
+    return self;
+}
+
+// The stack lock spaces that the threads used so far
+static lock_type stack_spaces[THREADS_AT_ONCE];
+static unsigned num_stack_spaces = 0;
+
+static int known_stack_space(lock_type space) {
+    for (unsigned i = 0; i < num_stack_spaces; i++) {
+        if (stack_spaces[i] == space) {
+            return 1;
+        }
+    }
+    if (num_stack_spaces == THREADS_AT_ONCE) {
+        return 0;
+    }
+    stack_spaces[num_stack_spaces++] = space;
+    return 1;
+}
+
+// Test: Threads exit without releasing their locks
+static int test_thread_exit(void) {
+    pthread_barrier_init(&exit_barrier, NULL, THREADS_AT_ONCE);
+    for (unsigned first = 0; first < NUM_THREADS; first += THREADS_AT_ONCE) {
+        pthread_t threads[THREADS_AT_ONCE];
+        for (unsigned i = 0; i < THREADS_AT_ONCE; i++) {
+            if (pthread_create(&threads[i], NULL, run_worker,
+                               &workers[first + i]) != 0) {
+                printf("could not create thread %u\n", first + i);
+                return 1;
+            }
+        }
+        for (unsigned i = 0; i < THREADS_AT_ONCE; i++) {
+            void *res;
+            pthread_join(threads[i], &res);
+            if (res != &workers[first + i]) {
+                printf("thread %u failed\n", first + i);
+                return 1;
+            }
+        }
+
+        // Check the stack locks before the next threads reuse their spaces
+        for (unsigned i = first; i < first + THREADS_AT_ONCE; i++) {
+            if (*(key_type *)workers[i].stack_lock != 0) {
+                printf("the stack lock of thread %u is still valid\n", i);
+                return 1;
+            }
+            if (!known_stack_space(workers[i].stack_lock)) {
+                printf("thread %u did not reuse a stack lock space\n", i);
+                return 1;
+            }
+        }
+    }
+
+    pthread_barrier_destroy(&exit_barrier);
+
+    for (unsigned i = 0; i < NUM_THREADS; i++) {
+        if (*(key_type *)workers[i].heap_lock != workers[i].heap_key) {
+            printf("the heap lock of thread %u was handed out again\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int softboundcets_pseudo_main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    if (test_thread_exit()) {
+        return 1;
+    }
+
+    printf("thread exit tests passed\n");
+    return 0;
+}
@@ -0,0 +1,252 @@
+// Regression test for the thread safety of the shadow stacks and the trie.
+//
+// It checks that
+//  - threads started by the pthread_create wrapper get the metadata of their
+//    argument on their own shadow stack,
+//  - threads started without the wrapper set up their shadow stack on its
+//    first use,
+//  - nested shadow stack frames of concurrent threads keep their metadata,
+//  - metadata stored concurrently into the same (new) secondary tables is not
+//    lost when several threads install a table for the same index.
+
+#include "softboundcets_common.h"
+#include "softboundcets_spatial.h"
+#include "softboundcets_temporal.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Usually called by the instrumentation
+void __softboundcets_init(void);
+
+int softboundcets_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                                 void *(*start_routine)(void *), void *arg);
+
+__attribute__((constructor)) static void init_runtime(void) {
+    __softboundcets_init();
+}
+
+#define NUM_THREADS 8
+// Number of primary table entries that all threads store metadata for
+#define NUM_TABLES 16
+#define ENTRIES_PER_TABLE 64
+#define ROUNDS 50
+#define SHADOW_STACK_DEPTH 32
+
+// Store metadata derived from value for the pointer at addr, load returns the
+// value again (or 0 if there is no metadata)
+static void store(const void *addr, size_t value) {
+#if __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_store(addr, (void *)value, (void *)(value + 1));
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_store(addr, value, (lock_type)value);
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_metadata_store(addr, (void *)value, (void *)(value + 1),
+                                   value, (lock_type)value);
+#endif
+}
+
+static size_t load(const void *addr) {
+#if __SOFTBOUNDCETS_SPATIAL
+    void *base, *bound;
+    __softboundcets_metadata_load(addr, &base, &bound);
+    return (size_t)base;
+#elif __SOFTBOUNDCETS_TEMPORAL
+    key_type key;
+    lock_type lock;
+    __softboundcets_metadata_load(addr, &key, &lock);
+    return key;
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    void *base, *bound;
+    key_type key;
+    lock_type lock;
+    __softboundcets_metadata_load(addr, &base, &bound, &key, &lock);
+    return key;
+#endif
+}
+
+// The same for the given slot of the current shadow stack frame
+static void store_shadow(size_t value, int slot) {
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_base_shadow_stack((void *)value, slot);
+    __softboundcets_store_bound_shadow_stack((void *)(value + 1), slot);
+#endif
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_key_shadow_stack(value, slot);
+    __softboundcets_store_lock_shadow_stack((lock_type)value, slot);
+#endif
+}
+
+static size_t load_shadow(int slot) {
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    size_t base = (size_t)__softboundcets_load_base_shadow_stack(slot);
+    if ((size_t)__softboundcets_load_bound_shadow_stack(slot) != base + 1) {
+        return 0;
+    }
+#endif
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    size_t key = __softboundcets_load_key_shadow_stack(slot);
+    if ((size_t)__softboundcets_load_lock_shadow_stack(slot) != key) {
+        return 0;
+    }
+#endif
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    return base;
+#else
+    return key;
+#endif
+}
+
+// The addresses the metadata is stored for, spread over NUM_TABLES entries of
+// the primary table. They are never accessed.
+static char *pointers;
+
+static const void *pointer_address(unsigned table, unsigned entry,
+                                   unsigned thread) {
+    return pointers + ((size_t)table << __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT) +
+           (entry * NUM_THREADS + thread) * sizeof(void *);
+}
+
+static size_t metadata_value(unsigned table, unsigned entry, unsigned thread) {
+    return ((size_t)(thread + 1) << 32) + table * ENTRIES_PER_TABLE + entry + 1;
+}
+
+typedef struct {
+    unsigned index;
+    int wrapped;
+} worker;
+
+static worker workers[NUM_THREADS];
+
+static pthread_barrier_t start_barrier;
+
+// Pushes nested frames onto the shadow stack of the calling thread, and checks
+// that every frame keeps its metadata
+static int shadow_stack_frames(size_t value, int depth) {
+    __softboundcets_allocate_shadow_stack_space(2);
+    store_shadow(value + depth, 0);
+    store_shadow(value - depth, 1);
+    int failed = depth > 0 && shadow_stack_frames(value, depth - 1);
+    failed = failed || load_shadow(0) != value + depth ||
+             load_shadow(1) != value - depth;
+    __softboundcets_deallocate_shadow_stack_space();
+    return failed;
+}
+
+static void *run_worker(void *arg) {
+    worker *self = arg;
+    // The wrapper passes the metadata of the argument in slot 1
+    if (self->wrapped && load_shadow(1) != (size_t)self) {
+        printf("thread %u: the argument has the wrong metadata\n",
+               self->index);
+        return NULL;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    size_t value = metadata_value(0, 0, self->index);
+    for (unsigned round = 0; round < ROUNDS; round++) {
+        if (shadow_stack_frames(value + round * 1000, SHADOW_STACK_DEPTH)) {
+            printf("thread %u: a shadow stack frame lost its metadata\n",
+                   self->index);
+            return NULL;
+        }
+    }
+
+    // All threads fill the same secondary tables at the same time
+    pthread_barrier_wait(&start_barrier);
+    for (unsigned entry = 0; entry < ENTRIES_PER_TABLE; entry++) {
+        for (unsigned table = 0; table < NUM_TABLES; table++) {
+            store(pointer_address(table, entry, self->index),
+                  metadata_value(table, entry, self->index));
+        }
+    }
+    return self;
+}
+
+static pthread_t threads[NUM_THREADS];
+
+// Starts the thread like instrumented code would call pthread_create, with the
+// metadata of the (global) thread handle and the argument on the shadow stack
+static int start_wrapped(pthread_t *thread, worker *arg) {
+    __softboundcets_allocate_shadow_stack_space(4);
+#if __SOFTBOUNDCETS_SPATIAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_base_shadow_stack(thread, 0);
+    __softboundcets_store_bound_shadow_stack(thread + 1, 0);
+#endif
+#if __SOFTBOUNDCETS_TEMPORAL || __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_store_key_shadow_stack(1, 0);
+    __softboundcets_store_lock_shadow_stack(__softboundcets_get_global_lock(),
+                                            0);
+#endif
+    store_shadow((size_t)arg, 3);
+    int res = softboundcets_pthread_create(thread, NULL, run_worker, arg);
+    __softboundcets_deallocate_shadow_stack_space();
+    return res;
+}
+
+// Test: Threads (with and without the wrapper) use their shadow stacks and the
+// trie concurrently
+static int test_concurrent_threads(void) {
+    size_t length = (size_t)NUM_TABLES << __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT;
+    pointers = mmap(NULL, length, PROT_NONE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (pointers == MAP_FAILED) {
+        printf("could not reserve the address range for the pointers\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, NUM_THREADS);
+    for (unsigned i = 0; i < NUM_THREADS; i++) {
+        workers[i].index = i;
+        workers[i].wrapped = i % 2 == 0;
+        int res = workers[i].wrapped
+                      ? start_wrapped(&threads[i], &workers[i])
+                      : pthread_create(&threads[i], NULL, run_worker,
+                                       &workers[i]);
+        if (res != 0) {
+            printf("could not create thread %u\n", i);
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    for (unsigned i = 0; i < NUM_THREADS; i++) {
+        void *res;
+        pthread_join(threads[i], &res);
+        failed |= res != &workers[i];
+    }
+    pthread_barrier_destroy(&start_barrier);
+    if (failed) {
+        return 1;
+    }
+
+    for (unsigned table = 0; table < NUM_TABLES; table++) {
+        for (unsigned entry = 0; entry < ENTRIES_PER_TABLE; entry++) {
+            for (unsigned thread = 0; thread < NUM_THREADS; thread++) {
+                if (load(pointer_address(table, entry, thread)) !=
+                    metadata_value(table, entry, thread)) {
+                    printf("the metadata of thread %u in table %u was lost\n",
+                           thread, table);
+                    return 1;
+                }
+            }
+        }
+    }
+    munmap(pointers, length);
+    return 0;
+}
+
+int softboundcets_pseudo_main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    if (test_concurrent_threads()) {
+        return 1;
+    }
+
+    printf("thread tests passed\n");
+    return 0;
+}